@@ -1,13 +1,36 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
+// Buffers are hashed on (dev, sectorno) into NBUCKET chains, each
+// guarded by its own spinlock, so a cache hit only touches one
+// bucket.  Buffers that nobody references (refcnt == 0) are also
+// kept on a separate LRU free list, guarded by bcache.lock, from
+// which victims are taken in O(1) on a miss.
+//
+// The cache starts with NBUF buffers and grows on demand, one page
+// of data (BUF_PER_PAGE sectors) at a time, up to NBUF_MAX buffers
+// while free memory stays above BCACHE_RESERVE pages.  When kalloc()
+// runs dry it calls breclaim(), which hands back whole pages whose
+// buffers are all unreferenced.
+//
+// Writes are delayed: bwrite only marks the buffer dirty.  The
+// bflush kernel thread writes buffers back once they have been dirty
+// for BFLUSH_AGE ticks, sorted by sector and in runs of consecutive
+// sectors; bflush(1) writes all of them at once for sync.  A dirty
+// buffer that reaches the tail of the LRU list is written back before
+// it is recycled, and breclaim() never frees a dirty buffer.
+//
+// Lock order: bucket lock, then bcache.lock.  Never hold two
+// bucket locks at once.  Sleep-locks on several buffers are always
+// taken in ascending sector order.
+//
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
-// * After changing buffer data, call bwrite to write it to disk.
+// * After changing buffer data, call bwrite to mark it for write-back.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
@@ -24,76 +47,278 @@
 #include "include/sdcard.h"
 #include "include/printf.h"
 #include "include/disk.h"
+#include "include/kalloc.h"
+#include "include/timer.h"
+#include "include/proc.h"
+#include "include/fat32.h"
 
-struct {
+#define BUF_PER_PAGE  (PGSIZE / BSIZE)
+#define NBUFPAGE      (NBUF_MAX / BUF_PER_PAGE)
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;       // hash chain, through hnext
+};
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
+struct {
+  struct spinlock lock;   // protects the free list and page[]
+  struct buf buf[NBUF_MAX];
+
+  // Data pages backing buf[i*BUF_PER_PAGE .. (i+1)*BUF_PER_PAGE-1],
+  // or 0 if those buffers are not in use.
+  uchar *page[NBUFPAGE];
+  int npage;
+
+  // List of unreferenced buffers, through prev/next.
+  // Sorted by how recently the buffer was released.
   // head.next is most recent, head.prev is least.
   struct buf head;
+
+  struct bucket bucket[NBUCKET];
 } bcache;
 
-void
-binit(void)
+static inline int
+bhash(uint dev, uint sectorno)
 {
-  struct buf *b;
+  return (dev + sectorno) % NBUCKET;
+}
 
-  initlock(&bcache.lock, "bcache");
+// Caller must hold bcache.lock.
+static void
+lru_remove(struct buf *b)
+{
+  b->next->prev = b->prev;
+  b->prev->next = b->next;
+}
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
+// Insert b as the most recently used free buffer.
+// Caller must hold bcache.lock.
+static void
+lru_insert(struct buf *b)
+{
+  b->next = bcache.head.next;
+  b->prev = &bcache.head;
+  bcache.head.next->prev = b;
+  bcache.head.next = b;
+}
+
+// Caller must hold bcache.bucket[b->bucket].lock.
+static void
+bucket_remove(struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = &bcache.bucket[b->bucket].head; *pp; pp = &(*pp)->hnext){
+    if(*pp == b){
+      *pp = b->hnext;
+      b->hnext = 0;
+      b->bucket = -1;
+      return;
+    }
+  }
+  panic("bucket_remove");
+}
+
+// Add one page worth of buffers to the cache, backed by pa.
+// Returns 0 if the cache is already at NBUF_MAX.
+static int
+baddpage(uchar *pa)
+{
+  struct buf *b;
+  int i;
+
+  acquire(&bcache.lock);
+  for(i = 0; i < NBUFPAGE; i++){
+    if(bcache.page[i] == 0)
+      break;
+  }
+  if(i == NBUFPAGE){
+    release(&bcache.lock);
+    return 0;
+  }
+  bcache.page[i] = pa;
+  bcache.npage++;
+  // New buffers start out unhashed on the free list.
+  for(b = bcache.buf + i*BUF_PER_PAGE; b < bcache.buf + (i+1)*BUF_PER_PAGE; b++){
     b->refcnt = 0;
+    b->valid = 0;
     b->sectorno = ~0;
     b->dev = ~0;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+    b->bucket = -1;
+    b->hnext = 0;
+    b->data = pa;
+    pa += BSIZE;
+    lru_insert(b);
+  }
+  release(&bcache.lock);
+  return 1;
+}
+
+// Grow the cache by one page if we are below the ceiling
+// and free memory allows it.  Called without any locks held.
+static int
+bgrow(void)
+{
+  uchar *pa;
+
+  if(bcache.npage >= NBUFPAGE || freemem_amount() < BCACHE_RESERVE * PGSIZE)
+    return 0;
+  if((pa = kalloc()) == NULL)
+    return 0;
+  if(!baddpage(pa)){
+    kfree(pa);
+    return 0;
+  }
+  return 1;
+}
+
+void
+binit(void)
+{
+  initlock(&bcache.lock, "bcache");
+  for(int i = 0; i < NBUCKET; i++){
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
+    bcache.bucket[i].head = 0;
+  }
+  for(struct buf *b = bcache.buf; b < bcache.buf+NBUF_MAX; b++)
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+
+  bcache.head.prev = &bcache.head;
+  bcache.head.next = &bcache.head;
+  bcache.npage = 0;
+  while(bcache.npage * BUF_PER_PAGE < NBUF){
+    uchar *pa = kalloc();
+    if(pa == NULL)
+      panic("binit");
+    baddpage(pa);
   }
   #ifdef DEBUG
   printf("binit\n");
   #endif
 }
 
+// Take the least recently used free buffer off the free list and
+// out of its hash chain.  The returned buffer is referenced by the
+// caller (refcnt == 1) and cannot be found by anyone else.
+// A dirty victim is written back first.
+// Must be called without any bucket lock held.
+static struct buf*
+bevict(void)
+{
+  struct buf *b;
+  int h;
+
+  for(;;){
+    acquire(&bcache.lock);
+    b = bcache.head.prev;
+    if(b == &bcache.head)
+      panic("bget: no buffers");
+    if(b->bucket < 0){
+      // not hashed, so nobody else can look it up.
+      lru_remove(b);
+      b->refcnt = 1;
+      release(&bcache.lock);
+      return b;
+    }
+    // b->bucket can't change while b is on the free list.
+    h = b->bucket;
+    release(&bcache.lock);
+
+    // Re-check under the bucket lock: b may have been
+    // looked up or evicted by someone else meanwhile.
+    acquire(&bcache.bucket[h].lock);
+    if(b->bucket == h && b->refcnt == 0){
+      acquire(&bcache.lock);
+      lru_remove(b);
+      release(&bcache.lock);
+      if(b->dirty){
+        // keep it hashed while writing it back, then start over:
+        // it goes to the head of the free list like any released buffer.
+        b->refcnt = 1;
+        release(&bcache.bucket[h].lock);
+        acquiresleep(&b->lock);
+        disk_write(b);
+        b->dirty = 0;
+        brelse(b);
+        continue;
+      }
+      bucket_remove(b);
+      b->refcnt = 1;
+      release(&bcache.bucket[h].lock);
+      return b;
+    }
+    release(&bcache.bucket[h].lock);
+  }
+}
+
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
 static struct buf*
 bget(uint dev, uint sectorno)
 {
-  struct buf *b;
+  struct buf *b, *victim;
+  int h = bhash(dev, sectorno);
+  struct bucket *bk = &bcache.bucket[h];
 
-  acquire(&bcache.lock);
+  acquire(&bk->lock);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+  for(b = bk->head; b; b = b->hnext){
     if(b->dev == dev && b->sectorno == sectorno){
-      b->refcnt++;
-      release(&bcache.lock);
+      if(b->refcnt++ == 0){
+        acquire(&bcache.lock);
+        lru_remove(b);
+        release(&bcache.lock);
+      }
+      release(&bk->lock);
       acquiresleep(&b->lock);
       return b;
     }
   }
+  release(&bk->lock);
 
   // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->sectorno = sectorno;
-      b->valid = 0;
-      b->refcnt = 1;
+  // Grow into free memory if we may, otherwise
+  // recycle the least recently used (LRU) unused buffer.
+  bgrow();
+  victim = bevict();
+
+  acquire(&bk->lock);
+  // Someone may have cached the block while we weren't holding the lock.
+  for(b = bk->head; b; b = b->hnext){
+    if(b->dev == dev && b->sectorno == sectorno){
+      if(b->refcnt++ == 0){
+        acquire(&bcache.lock);
+        lru_remove(b);
+        release(&bcache.lock);
+      }
+      release(&bk->lock);
+      // give the victim back, unhashed, as the next one to recycle.
+      acquire(&bcache.lock);
+      victim->refcnt = 0;
+      victim->dev = ~0;
+      victim->sectorno = ~0;
+      victim->next = &bcache.head;
+      victim->prev = bcache.head.prev;
+      bcache.head.prev->next = victim;
+      bcache.head.prev = victim;
       release(&bcache.lock);
       acquiresleep(&b->lock);
       return b;
     }
   }
-  panic("bget: no buffers");
+  b = victim;
+  b->dev = dev;
+  b->sectorno = sectorno;
+  b->valid = 0;
+  b->dirty = 0;
+  b->bucket = h;
+  b->hnext = bk->head;
+  bk->head = b;
+  release(&bk->lock);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -110,12 +335,104 @@ bread(uint dev, uint sectorno) {
   return b;
 }
 
-// Write b's contents to disk.  Must be locked.
+// Return n locked buffers with the contents of the consecutive
+// sectors starting at sectorno. Buffers are taken in ascending
+// sector order, and the ones not cached are read in as few
+// device requests as possible.
+void
+breadn(uint dev, uint sectorno, int n, struct buf **bufs)
+{
+  int i, j, k;
+
+  if(n < 1 || n > DISK_VEC_MAX)
+    panic("breadn");
+  for(i = 0; i < n; i++)
+    bufs[i] = bget(dev, sectorno + i);
+  for(i = 0; i < n; i = j){
+    j = i + 1;
+    if(bufs[i]->valid)
+      continue;
+    while(j < n && !bufs[j]->valid)
+      j++;
+    disk_rw_vec(bufs + i, j - i, 0);
+    for(k = i; k < j; k++)
+      bufs[k]->valid = 1;
+  }
+}
+
+static void bput(struct buf *b);
+
+// Completion of a read-ahead request, called from the disk
+// interrupt: the buffers are released on behalf of bprefetch().
+static void
+bprefetch_done(struct buf **bufs, int n)
+{
+  for(int i = 0; i < n; i++){
+    bufs[i]->valid = 1;
+    releasesleep(&bufs[i]->lock);
+    bput(bufs[i]);
+  }
+}
+
+// Start bringing n consecutive sectors into the cache,
+// without waiting for the disk.
+void
+bprefetch(uint dev, uint sectorno, int n)
+{
+  struct buf *bufs[DISK_VEC_MAX];
+  int i, j;
+
+  if(n < 1 || n > DISK_VEC_MAX)
+    panic("bprefetch");
+  for(i = 0; i < n; i++)
+    bufs[i] = bget(dev, sectorno + i);
+  for(i = 0; i < n; i = j){
+    j = i + 1;
+    if(bufs[i]->valid){
+      brelse(bufs[i]);
+      continue;
+    }
+    while(j < n && !bufs[j]->valid)
+      j++;
+    disk_submit(bufs + i, j - i, 0, bprefetch_done);
+  }
+}
+
+// Mark b for write-back.  Must be locked.
 void 
 bwrite(struct buf *b) {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
-  disk_write(b);
+  if(!b->dirty){
+    b->dirty = 1;
+    b->dirtytick = timer_ticks();
+  }
+}
+
+// Mark n locked buffers for write-back.
+void
+bwriten(struct buf **bufs, int n)
+{
+  for(int i = 0; i < n; i++)
+    bwrite(bufs[i]);
+}
+
+// Drop a reference to b.  The last reference puts it at the
+// head of the most-recently-used free list.
+static void
+bput(struct buf *b)
+{
+  struct bucket *bk = &bcache.bucket[b->bucket];
+
+  acquire(&bk->lock);
+  b->refcnt--;
+  if (b->refcnt == 0) {
+    // no one is waiting for it.
+    acquire(&bcache.lock);
+    lru_insert(b);
+    release(&bcache.lock);
+  }
+  release(&bk->lock);
 }
 
 // Release a locked buffer.
@@ -127,34 +444,244 @@ brelse(struct buf *b)
     panic("brelse");
 
   releasesleep(&b->lock);
-
-  acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  bput(b);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = &bcache.bucket[b->bucket];
+
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
+  bput(b);
+}
+
+// Try to claim b for reclaiming: it must be unreferenced.
+// On success b is off the free list and out of its hash chain.
+static int
+bclaim(struct buf *b)
+{
+  int h;
+
+  for(;;){
+    acquire(&bcache.lock);
+    if(b->refcnt != 0 || b->data == 0 || b->dirty){   // in use, page already gone, or not written back
+      release(&bcache.lock);
+      return 0;
+    }
+    if(b->bucket < 0){
+      lru_remove(b);
+      b->refcnt = 1;
+      release(&bcache.lock);
+      return 1;
+    }
+    h = b->bucket;
+    release(&bcache.lock);
+
+    acquire(&bcache.bucket[h].lock);
+    if(b->bucket == h){
+      int ok = (b->refcnt == 0);
+      if(ok){
+        acquire(&bcache.lock);
+        lru_remove(b);
+        release(&bcache.lock);
+        bucket_remove(b);
+        b->refcnt = 1;
+      }
+      release(&bcache.bucket[h].lock);
+      return ok;
+    }
+    release(&bcache.bucket[h].lock);
+  }
+}
+
+// Give back a buffer claimed by bclaim(), still holding its
+// sector's data: hashed again, unless someone has read the
+// sector into another buffer meanwhile.  It is clean, so
+// nothing is lost if not.
+static void
+bunclaim(struct buf *b)
+{
+  struct buf *p;
+  int h = bhash(b->dev, b->sectorno);
+
+  acquire(&bcache.bucket[h].lock);
+  if(b->valid && b->dev != ~0){
+    for(p = bcache.bucket[h].head; p; p = p->hnext)
+      if(p->dev == b->dev && p->sectorno == b->sectorno)
+        break;
+    if(p == 0){
+      b->bucket = h;
+      b->hnext = bcache.bucket[h].head;
+      bcache.bucket[h].head = b;
+    } else {
+      b->valid = 0;
+      b->dev = ~0;
+      b->sectorno = ~0;
+    }
+  }
   acquire(&bcache.lock);
-  b->refcnt--;
+  b->refcnt = 0;
+  lru_insert(b);
+  release(&bcache.lock);
+  release(&bcache.bucket[h].lock);
+}
+
+// Give memory back to kalloc() under memory pressure.
+// Frees at most one page whose buffers are all unused, but never
+// shrinks the cache below NBUF buffers.
+// Returns 1 if a page was freed, 0 otherwise.
+int
+breclaim(void)
+{
+  struct buf *b, *first;
+  uchar *pa;
+
+  // take the page off the count up front, so that
+  // concurrent reclaimers can't both pass the floor.
+  acquire(&bcache.lock);
+  if(bcache.npage * BUF_PER_PAGE <= NBUF){
+    release(&bcache.lock);
+    return 0;
+  }
+  bcache.npage--;
+  release(&bcache.lock);
+
+  for(int i = NBUFPAGE - 1; i >= 0; i--){
+    // a hint only: bclaim() fails on a buffer whose page is gone.
+    if(bcache.page[i] == 0)
+      continue;
+    first = bcache.buf + i*BUF_PER_PAGE;
+    for(b = first; b < first + BUF_PER_PAGE; b++){
+      if(!bclaim(b))
+        break;
+    }
+    if(b < first + BUF_PER_PAGE){
+      // page is busy; put back what we took.
+      while(b-- > first)
+        bunclaim(b);
+      continue;
+    }
+    acquire(&bcache.lock);
+    pa = bcache.page[i];
+    bcache.page[i] = 0;
+    for(b = first; b < first + BUF_PER_PAGE; b++){
+      b->refcnt = 0;
+      b->data = 0;
+    }
+    release(&bcache.lock);
+    kfree(pa);
+    return 1;
+  }
+  acquire(&bcache.lock);
+  bcache.npage++;
   release(&bcache.lock);
+  return 0;
 }
 
+// Take a reference to b if it is still cached, leaving it hashed.
+// Unless busy is set, only if nobody holds it, so that its
+// sleep-lock is free for the taking; otherwise acquiring that
+// waits for whoever is using b, or for the disk.
+static int
+bgrab(struct buf *b, int busy)
+{
+  int h, ok;
+
+  for(;;){
+    acquire(&bcache.lock);
+    if((b->refcnt != 0 && !busy) || b->data == 0 || b->bucket < 0){
+      release(&bcache.lock);
+      return 0;
+    }
+    h = b->bucket;
+    release(&bcache.lock);
+
+    acquire(&bcache.bucket[h].lock);
+    if(b->bucket == h){
+      ok = (b->refcnt == 0 || busy);
+      if(ok && b->refcnt++ == 0){
+        acquire(&bcache.lock);
+        lru_remove(b);
+        release(&bcache.lock);
+      }
+      release(&bcache.bucket[h].lock);
+      return ok;
+    }
+    release(&bcache.bucket[h].lock);
+  }
+}
+
+// Write back dirty buffers, BFLUSH_BATCH at a time, sorted by sector
+// and merged into runs of consecutive sectors.
+// If all is 0, only buffers dirty for at least BFLUSH_AGE ticks that
+// nobody is using go; those in use are left to a later flush.
+// If all is 1, every buffer goes, waiting for those in use, and
+// for reads and writes already in flight, to be done with first.
+void
+bflush(int all)
+{
+  struct buf *batch[BFLUSH_BATCH], *b;
+  int i, j, n;
+  int next = 0;
+  uint now = timer_ticks();
 
+  while(next < NBUF_MAX){
+    n = 0;
+    for(; next < NBUF_MAX && n < BFLUSH_BATCH; next++){
+      b = &bcache.buf[next];
+      // dirty and dirtytick only change while b is referenced,
+      // so this peek is rechecked once we hold b.
+      if(all ? !b->dirty && b->refcnt == 0
+             : !b->dirty || now - b->dirtytick < BFLUSH_AGE)
+        continue;
+      if(!bgrab(b, all))
+        continue;
+      // insertion sort on (dev, sectorno)
+      for(i = n++; i > 0; i--){
+        struct buf *p = batch[i-1];
+        if(p->dev < b->dev || (p->dev == b->dev && p->sectorno < b->sectorno))
+          break;
+        batch[i] = p;
+      }
+      batch[i] = b;
+    }
+    for(i = 0; i < n; i++)
+      acquiresleep(&batch[i]->lock);
+    // queue every run before waiting for any of them.
+    for(i = 0; i < n; i = j){
+      j = i + 1;
+      if(!batch[i]->dirty)
+        continue;
+      while(j < n && j - i < DISK_VEC_MAX && batch[j]->dirty
+            && batch[j]->dev == batch[i]->dev
+            && batch[j]->sectorno == batch[j-1]->sectorno + 1)
+        j++;
+      disk_submit(batch + i, j - i, 1, 0);
+    }
+    for(i = 0; i < n; i++){
+      if(batch[i]->dirty){
+        disk_wait(batch[i]);
+        batch[i]->dirty = 0;
+      }
+      brelse(batch[i]);
+    }
+  }
+}
+
+// Kernel thread that writes back aged dirty buffers,
+// and the FAT, which the file system caches on its own.
+void
+bflusher(void)
+{
+  for(;;){
+    timer_sleep(r_time() + BFLUSH_INTERVAL * INTERVAL);
+    fat_flush();
+    bflush(0);
+  }
+}
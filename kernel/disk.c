@@ -39,6 +39,46 @@ void disk_write(struct buf *b)
 	#endif
 }
 
+// Move n buffers of consecutive sectors, starting at
+// bufs[0]->sectorno, in one device request.
+void disk_rw_vec(struct buf **bufs, int n, int write)
+{
+    #ifdef QEMU
+    virtio_disk_rw_vec(bufs, n, write);
+    #else
+    uint8 *data[DISK_VEC_MAX];
+    for (int i = 0; i < n; i++)
+        data[i] = bufs[i]->data;
+    if (write)
+        sdcard_write_sectors(data, bufs[0]->sectorno, n);
+    else
+        sdcard_read_sectors(data, bufs[0]->sectorno, n);
+    #endif
+}
+
+// Start moving n buffers of consecutive sectors and return.
+// done(bufs, n), if not 0, is called from the disk interrupt
+// once the transfer is over; disk_wait(bufs[0]) waits for it.
+// The SD card driver can only do programmed I/O, so there the
+// transfer (and done) happen before disk_submit returns.
+void disk_submit(struct buf **bufs, int n, int write, void (*done)(struct buf **, int))
+{
+    #ifdef QEMU
+    virtio_disk_submit(bufs, n, write, done);
+    #else
+    disk_rw_vec(bufs, n, write);
+    if (done)
+        done(bufs, n);
+    #endif
+}
+
+void disk_wait(struct buf *b)
+{
+    #ifdef QEMU
+    virtio_disk_wait(b);
+    #endif
+}
+
 void disk_intr(void)
 {
     #ifdef QEMU
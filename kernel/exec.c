@@ -12,16 +12,23 @@
 #include "include/vm.h"
 #include "include/printf.h"
 #include "include/string.h"
+#include "include/file.h"
+#include "include/fcntl.h"
+
+// Program segments mapped lazily; any more are loaded up front.
+#define NSEG 4
 
 // Load a program segment into pagetable at virtual address va.
 // va must be page-aligned
 // and the pages from va to va+sz must already be mapped.
+// Whole pages at page-aligned file offsets are replaced by
+// the page cache's own, so programs share their text.
 // Returns 0 on success, -1 on failure.
 static int
 loadseg(pagetable_t pagetable, uint64 va, struct dirent *ep, uint offset, uint sz)
 {
   uint i, n;
-  uint64 pa;
+  uint64 pa, cpa;
   if((va % PGSIZE) != 0)
     panic("loadseg: va must be page aligned");
 
@@ -33,6 +40,10 @@ loadseg(pagetable_t pagetable, uint64 va, struct dirent *ep, uint offset, uint s
       n = sz - i;
     else
       n = PGSIZE;
+    if(n == PGSIZE && (offset + i) % PGSIZE == 0 && (cpa = epage_ref(ep, offset + i)) != 0){
+      uvmreplace(pagetable, va + i, cpa);
+      continue;
+    }
     if(eread(ep, 0, (uint64)pa, offset+i, n) != n)
       return -1;
   }
@@ -50,18 +61,10 @@ int exec(char *path, char **argv)
   struct dirent *ep;
   struct proghdr ph;
   pagetable_t pagetable = 0, oldpagetable;
-  pagetable_t kpagetable = 0, oldkpagetable;
   struct proc *p = myproc();
-
-  // Make a copy of p->kpt without old user space, 
-  // but with the same kstack we are using now, which can't be changed
-  if ((kpagetable = (pagetable_t)kalloc()) == NULL) {
-    return -1;
-  }
-  memmove(kpagetable, p->kpagetable, PGSIZE);
-  for (int i = 0; i < PX(2, MAXUVA); i++) {
-    kpagetable[i] = 0;
-  }
+  struct file *f = 0;
+  struct vma seg[NSEG];
+  int nseg = 0;
 
   if((ep = ename(path)) == NULL) {
     #ifdef DEBUG
@@ -87,20 +90,50 @@ int exec(char *path, char **argv)
       continue;
     if(ph.memsz < ph.filesz)
       goto bad;
-    if(ph.vaddr + ph.memsz < ph.vaddr)
+    if(ph.vaddr + ph.memsz < ph.vaddr || ph.vaddr + ph.memsz > MMAPBASE)
       goto bad;
+    if(ph.vaddr % PGSIZE != 0)
+      goto bad;
+    if(ph.off % PGSIZE == 0 && nseg < NSEG){
+      // Record the segment; vma_fault() reads it in on first
+      // touch, sharing whole pages with the page cache.
+      if(f == 0){
+        if((f = filealloc()) == NULL)
+          goto bad;
+        f->type = FD_ENTRY;
+        f->readable = 1;
+        f->ep = edup(ep);
+      }
+      seg[nseg].start = ph.vaddr;
+      seg[nseg].end = PGROUNDUP(ph.vaddr + ph.memsz);
+      seg[nseg].prot = PROT_READ;
+      if(ph.flags & ELF_PROG_FLAG_WRITE)
+        seg[nseg].prot |= PROT_WRITE;
+      if(ph.flags & ELF_PROG_FLAG_EXEC)
+        seg[nseg].prot |= PROT_EXEC;
+      seg[nseg].flags = MAP_PRIVATE;
+      seg[nseg].f = filedup(f);
+      seg[nseg].off = ph.off;
+      seg[nseg].fsize = ph.filesz;
+      nseg++;
+      if(ph.vaddr + ph.memsz > sz)
+        sz = ph.vaddr + ph.memsz;
+      continue;
+    }
     uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, kpagetable, sz, ph.vaddr + ph.memsz)) == 0)
+    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
       goto bad;
     sz = sz1;
-    if(ph.vaddr % PGSIZE != 0)
-      goto bad;
     if(loadseg(pagetable, ph.vaddr, ep, ph.off, ph.filesz) < 0)
       goto bad;
   }
   eunlock(ep);
   eput(ep);
   ep = 0;
+  if(f){
+    fileclose(f);           // the segments hold it now
+    f = 0;
+  }
 
   p = myproc();
   uint64 oldsz = p->sz;
@@ -109,7 +142,7 @@ int exec(char *path, char **argv)
   // Use the second as the user stack.
   sz = PGROUNDUP(sz);
   uint64 sz1;
-  if((sz1 = uvmalloc(pagetable, kpagetable, sz, sz + 2*PGSIZE)) == 0)
+  if((sz1 = uvmalloc(pagetable, sz, sz + 2*PGSIZE)) == 0)
     goto bad;
   sz = sz1;
   uvmclear(pagetable, sz-2*PGSIZE);
@@ -160,17 +193,16 @@ int exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  vma_exit(p);
+  for(i = 0; i < nseg; i++)
+    p->vma[i] = seg[i];
   oldpagetable = p->pagetable;
-  oldkpagetable = p->kpagetable;
   p->pagetable = pagetable;
-  p->kpagetable = kpagetable;
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
+  uvmflush(p);            // off the old page table before freeing it
   proc_freepagetable(oldpagetable, oldsz);
-  w_satp(MAKE_SATP(p->kpagetable));
-  sfence_vma();
-  kvmfree(oldkpagetable, 0);
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
  bad:
@@ -179,11 +211,13 @@ int exec(char *path, char **argv)
   #endif
   if(pagetable)
     proc_freepagetable(pagetable, sz);
-  if(kpagetable)
-    kvmfree(kpagetable, 0);
   if(ep){
     eunlock(ep);
     eput(ep);
   }
+  for(i = 0; i < nseg; i++)
+    fileclose(seg[i].f);
+  if(f)
+    fileclose(f);
   return -1;
 }
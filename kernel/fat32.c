@@ -9,6 +9,10 @@
 #include "include/fat32.h"
 #include "include/string.h"
 #include "include/printf.h"
+#include "include/kalloc.h"
+#include "include/disk.h"
+#include "include/slab.h"
+#include "include/pcache.h"
 
 /* fields that start with "_" are something we don't use */
 
@@ -58,17 +62,69 @@ static struct {
         uint32  tot_sec;            /* total count of sectors including all regions */
         uint32  fat_sz;             /* count of sectors for a FAT region */
         uint32  root_clus;
+        uint16  fs_info;            /* sector number of FSInfo */
     } bpb;
 
 } fat;
 
+// Entries come from an object cache: ENTRY_CACHE_NUM of them at boot,
+// more whenever every cached entry is in use.
 static struct entry_cache {
     struct spinlock lock;
-    struct dirent entries[ENTRY_CACHE_NUM];
+    struct kmem_cache *cache;
+    int nentry;
 } ecache;
 
 static struct dirent root;
 
+#define FAT_PER_PAGE    (PGSIZE / sizeof(uint32))     // FAT entries in a cached page
+#define SEC_PER_PAGE    (PGSIZE / BSIZE)
+
+/*
+ * In-memory cache of FAT #1, in page-sized pieces. It keeps FAT traffic
+ * out of the buffer cache. Small volumes end up fully resident, larger
+ * ones page through FATCACHE_NUM pages in LRU order. Updates only mark
+ * the sectors dirty; they reach the disk (every FAT copy) when the page
+ * is recycled or on fat_flush(), from sync or the buffer flusher.
+ */
+struct fat_page {
+    uint32  pageno;         // index of this page in FAT #1
+    int     valid;          // pageno is assigned
+    int     loaded;         // ents hold the disk contents
+    int     ref;
+    uint8   dirty;          // bitmap of dirty sectors in this page
+    struct sleeplock lock;
+    struct buf io;          // I/O descriptor only, never enters the buffer cache
+    uint32  *ents;
+    struct fat_page *prev;
+    struct fat_page *next;
+};
+
+static struct {
+    struct spinlock lock;
+    struct fat_page page[FATCACHE_NUM];
+    struct fat_page head;   // LRU list, head.next is most recent
+} fcache;
+
+/*
+ * Free-cluster bitmap, one bit per cluster, set if the cluster is in use.
+ * Built from the FAT at boot so that alloc_clus() never has to scan the
+ * FAT. free/hint mirror the FSInfo fields and are written back with the FAT.
+ */
+#define BITS_PER_PAGE   (PGSIZE * 8)
+
+static struct {
+    struct spinlock lock;
+    uint64  *map[FREEMAP_PAGES];
+    uint32  free;           // count of free clusters
+    uint32  hint;           // where the next search starts
+    int     dirty;          // FSInfo is out of date
+} fmap;
+
+static void fat_cache_init(void);
+static void fmap_init(void);
+static struct dirent *enew(void);
+
 /**
  * Read the Boot Parameter Block.
  * @return  0       if success
@@ -91,6 +147,7 @@ int fat32_init()
     fat.bpb.tot_sec = *(uint32 *)(b->data + 32);
     fat.bpb.fat_sz = *(uint32 *)(b->data + 36);
     fat.bpb.root_clus = *(uint32 *)(b->data + 44);
+    fat.bpb.fs_info = *(uint16 *)(b->data + 48);
     fat.first_data_sec = fat.bpb.rsvd_sec_cnt + fat.bpb.fat_cnt * fat.bpb.fat_sz;
     fat.data_sec_cnt = fat.bpb.tot_sec - fat.first_data_sec;
     fat.data_clus_cnt = fat.data_sec_cnt / fat.bpb.sec_per_clus;
@@ -109,6 +166,8 @@ int fat32_init()
     // make sure that byts_per_sec has the same value with BSIZE 
     if (BSIZE != fat.bpb.byts_per_sec) 
         panic("byts_per_sec != BSIZE");
+    fat_cache_init();
+    fmap_init();
     initlock(&ecache.lock, "ecache");
     memset(&root, 0, sizeof(root));
     initsleeplock(&root.lock, "entry");
@@ -117,21 +176,36 @@ int fat32_init()
     root.valid = 1;
     root.prev = &root;
     root.next = &root;
-    for(struct dirent *de = ecache.entries; de < ecache.entries + ENTRY_CACHE_NUM; de++) {
-        de->dev = 0;
-        de->valid = 0;
-        de->ref = 0;
-        de->dirty = 0;
-        de->parent = 0;
-        de->next = root.next;
-        de->prev = &root;
-        initsleeplock(&de->lock, "entry");
-        root.next->prev = de;
-        root.next = de;
+    ecache.cache = kmem_cache_create("dirent", sizeof(struct dirent));
+    ecache.nentry = 0;
+    acquire(&ecache.lock);
+    for (int i = 0; i < ENTRY_CACHE_NUM; i++) {
+        if (enew() == NULL)
+            panic("fat32_init: ecache");
     }
+    release(&ecache.lock);
     return 0;
 }
 
+/**
+ * Allocate one more unused entry and put it at the LRU end of ecache.
+ * Caller must hold ecache.lock.
+ */
+static struct dirent *enew(void)
+{
+    struct dirent *de = kmem_cache_alloc(ecache.cache);
+    if (de == NULL)
+        return NULL;
+    memset(de, 0, sizeof(*de));
+    initsleeplock(&de->lock, "entry");
+    de->next = &root;
+    de->prev = root.prev;
+    root.prev->next = de;
+    root.prev = de;
+    ecache.nentry++;
+    return de;
+}
+
 /**
  * @param   cluster   cluster number starts from 2, which means no 0 and 1
  */
@@ -159,6 +233,165 @@ static inline uint32 fat_offset_of_clus(uint32 cluster)
     return (cluster << 2) % fat.bpb.byts_per_sec;
 }
 
+static void fat_cache_init(void)
+{
+    uint32 need = (fat.bpb.fat_sz + SEC_PER_PAGE - 1) / SEC_PER_PAGE;
+    initlock(&fcache.lock, "fcache");
+    fcache.head.prev = fcache.head.next = &fcache.head;
+    for (struct fat_page *fp = fcache.page; fp < fcache.page + FATCACHE_NUM && fp - fcache.page < need; fp++) {
+        if ((fp->ents = kalloc()) == NULL)
+            panic("fat_cache_init");
+        fp->valid = 0;
+        fp->loaded = 0;
+        fp->ref = 0;
+        fp->dirty = 0;
+        initsleeplock(&fp->lock, "fat page");
+        fp->next = fcache.head.next;
+        fp->prev = &fcache.head;
+        fcache.head.next->prev = fp;
+        fcache.head.next = fp;
+    }
+}
+
+/**
+ * Move a FAT page between memory and disk, sector by sector.
+ * Reads come from FAT #1, writes of dirty sectors go to every FAT.
+ * The descriptor lives in fp, not on the stack, because the disk
+ * driver touches it from the interrupt handler, on any hart.
+ * Caller must hold fp->lock.
+ */
+static void fat_page_rw(struct fat_page *fp, int write)
+{
+    struct buf *b = &fp->io;
+    uint32 sec = fp->pageno * SEC_PER_PAGE;
+    for (int i = 0; i < SEC_PER_PAGE && sec + i < fat.bpb.fat_sz; i++) {
+        b->dev = 0;
+        b->data = (uchar *)fp->ents + i * BSIZE;
+        if (!write) {
+            b->sectorno = fat.bpb.rsvd_sec_cnt + sec + i;
+            disk_read(b);
+        } else if (fp->dirty & (1 << i)) {
+            for (int n = 0; n < fat.bpb.fat_cnt; n++) {
+                b->sectorno = fat.bpb.rsvd_sec_cnt + fat.bpb.fat_sz * n + sec + i;
+                disk_write(b);
+            }
+        }
+    }
+    if (write)
+        fp->dirty = 0;
+}
+
+static void fat_put(struct fat_page *fp)
+{
+    releasesleep(&fp->lock);
+    acquire(&fcache.lock);
+    fp->ref--;
+    release(&fcache.lock);
+}
+
+/**
+ * Return the locked, loaded cache page holding the FAT entries of page pageno.
+ */
+static struct fat_page *fat_get(uint32 pageno)
+{
+    struct fat_page *fp;
+    for (;;) {
+        acquire(&fcache.lock);
+        for (fp = fcache.head.next; fp != &fcache.head; fp = fp->next) {
+            if (fp->valid && fp->pageno == pageno) {
+                fp->ref++;
+                goto found;
+            }
+        }
+        // Not cached, recycle the LRU clean page.
+        for (fp = fcache.head.prev; fp != &fcache.head; fp = fp->prev) {
+            if (fp->ref == 0 && fp->dirty == 0) {
+                fp->ref = 1;
+                fp->pageno = pageno;
+                fp->valid = 1;
+                fp->loaded = 0;
+                goto found;
+            }
+        }
+        // Every free page is dirty, clean the LRU one and look again.
+        for (fp = fcache.head.prev; fp != &fcache.head; fp = fp->prev) {
+            if (fp->ref == 0)
+                break;
+        }
+        if (fp == &fcache.head)
+            panic("fat_get: no pages");
+        fp->ref++;
+        release(&fcache.lock);
+        acquiresleep(&fp->lock);
+        fat_page_rw(fp, 1);
+        fat_put(fp);
+    }
+
+found:
+    fp->next->prev = fp->prev;
+    fp->prev->next = fp->next;
+    fp->next = fcache.head.next;
+    fp->prev = &fcache.head;
+    fcache.head.next->prev = fp;
+    fcache.head.next = fp;
+    release(&fcache.lock);
+    acquiresleep(&fp->lock);
+    if (!fp->loaded) {
+        fat_page_rw(fp, 0);
+        fp->loaded = 1;
+    }
+    return fp;
+}
+
+/**
+ * Write every dirty FAT page back to disk.
+ */
+void fat_flush(void)
+{
+    for (struct fat_page *fp = fcache.page; fp < fcache.page + FATCACHE_NUM; fp++) {
+        if (fp->ents == NULL)
+            break;
+        acquire(&fcache.lock);
+        if (!fp->valid || !fp->dirty) {
+            release(&fcache.lock);
+            continue;
+        }
+        fp->ref++;
+        release(&fcache.lock);
+        acquiresleep(&fp->lock);
+        fat_page_rw(fp, 1);
+        fat_put(fp);
+    }
+
+    acquire(&fmap.lock);
+    if (!fmap.dirty || fat.bpb.fs_info == 0 || fat.bpb.fs_info == 0xffff) {
+        release(&fmap.lock);
+        return;
+    }
+    uint32 free = fmap.free;
+    uint32 hint = fmap.hint;
+    fmap.dirty = 0;
+    release(&fmap.lock);
+
+    struct buf *b = bread(0, fat.bpb.fs_info);
+    if (*(uint32 *)b->data == FSI_LEAD_SIG && *(uint32 *)(b->data + 484) == FSI_STRUC_SIG) {
+        *(uint32 *)(b->data + 488) = free;
+        *(uint32 *)(b->data + 492) = hint;
+        bwrite(b);
+    }
+    brelse(b);
+}
+
+/**
+ * Write everything the file system has delayed to disk:
+ * the FAT, FSInfo and all dirty buffers.
+ */
+void fat32_sync(void)
+{
+    fat_flush();
+    bflush(1);
+}
+
 /**
  * Read the FAT table content corresponded to the given cluster number.
  * @param   cluster     the number of cluster which you want to read its content in FAT table
@@ -171,11 +404,9 @@ static uint32 read_fat(uint32 cluster)
     if (cluster > fat.data_clus_cnt + 1) {     // because cluster number starts at 2, not 0
         return 0;
     }
-    uint32 fat_sec = fat_sec_of_clus(cluster, 1);
-    // here should be a cache layer for FAT table, but not implemented yet.
-    struct buf *b = bread(0, fat_sec);
-    uint32 next_clus = *(uint32 *)(b->data + fat_offset_of_clus(cluster));
-    brelse(b);
+    struct fat_page *fp = fat_get(cluster / FAT_PER_PAGE);
+    uint32 next_clus = fp->ents[cluster % FAT_PER_PAGE];
+    fat_put(fp);
     return next_clus;
 }
 
@@ -189,15 +420,137 @@ static int write_fat(uint32 cluster, uint32 content)
     if (cluster > fat.data_clus_cnt + 1) {
         return -1;
     }
-    uint32 fat_sec = fat_sec_of_clus(cluster, 1);
-    struct buf *b = bread(0, fat_sec);
-    uint off = fat_offset_of_clus(cluster);
-    *(uint32 *)(b->data + off) = content;
-    bwrite(b);
-    brelse(b);
+    struct fat_page *fp = fat_get(cluster / FAT_PER_PAGE);
+    fp->ents[cluster % FAT_PER_PAGE] = content;
+    fp->dirty |= 1 << (cluster % FAT_PER_PAGE) / (BSIZE / sizeof(uint32));
+    fat_put(fp);
     return 0;
 }
 
+static inline int fmap_test(uint32 clus)
+{
+    return (fmap.map[clus / BITS_PER_PAGE][clus % BITS_PER_PAGE / 64] >> (clus % 64)) & 1;
+}
+
+static inline void fmap_set(uint32 clus)
+{
+    fmap.map[clus / BITS_PER_PAGE][clus % BITS_PER_PAGE / 64] |= 1UL << (clus % 64);
+}
+
+static inline void fmap_clear(uint32 clus)
+{
+    fmap.map[clus / BITS_PER_PAGE][clus % BITS_PER_PAGE / 64] &= ~(1UL << (clus % 64));
+}
+
+/**
+ * Build the free-cluster bitmap from FAT #1 and check it against FSInfo.
+ * Clusters 0, 1 and the tail of the last word never count as free.
+ */
+static void fmap_init(void)
+{
+    uint32 const nclus = fat.data_clus_cnt + 2;
+    uint32 const npage = (nclus + BITS_PER_PAGE - 1) / BITS_PER_PAGE;
+    if (npage > FREEMAP_PAGES)
+        panic("fmap_init: volume too large");
+    initlock(&fmap.lock, "fmap");
+    for (int i = 0; i < npage; i++) {
+        if ((fmap.map[i] = kalloc()) == NULL)
+            panic("fmap_init: kalloc");
+        memset(fmap.map[i], 0xff, PGSIZE);
+    }
+
+    fmap.free = 0;
+    for (uint32 pageno = 0; pageno * FAT_PER_PAGE < nclus; pageno++) {
+        struct fat_page *fp = fat_get(pageno);
+        for (uint32 j = 0; j < FAT_PER_PAGE; j++) {
+            uint32 clus = pageno * FAT_PER_PAGE + j;
+            if (clus >= nclus) { break; }
+            if (clus >= 2 && fp->ents[j] == 0) {
+                fmap_clear(clus);
+                fmap.free++;
+            }
+        }
+        fat_put(fp);
+    }
+
+    fmap.hint = 2;
+    fmap.dirty = 0;
+    if (fat.bpb.fs_info == 0 || fat.bpb.fs_info == 0xffff)
+        return;
+    struct buf *b = bread(0, fat.bpb.fs_info);
+    if (*(uint32 *)b->data == FSI_LEAD_SIG && *(uint32 *)(b->data + 484) == FSI_STRUC_SIG) {
+        uint32 free = *(uint32 *)(b->data + 488);
+        uint32 hint = *(uint32 *)(b->data + 492);
+        if (hint >= 2 && hint < nclus)
+            fmap.hint = hint;
+        if (free != fmap.free) {
+            printf("fat32: FSInfo free count %d, FAT says %d\n", free, fmap.free);
+            fmap.dirty = 1;
+        }
+    }
+    brelse(b);
+}
+
+/**
+ * Claim a run of free clusters in the bitmap. The run starts at goal if
+ * that cluster is free, otherwise at the first free cluster after the hint.
+ * @param   goal        preferred first cluster, 0 for none
+ * @param   want        the most clusters the caller wants
+ * @param   got         receives the length of the run, at least 1
+ * @return  the first cluster of the run, or 0 if the volume is full
+ */
+static uint32 fmap_alloc(uint32 goal, uint32 want, uint32 *got)
+{
+    uint32 const nclus = fat.data_clus_cnt + 2;
+    uint32 const nword = (nclus + 63) / 64;
+    uint32 start = 0;
+    acquire(&fmap.lock);
+    if (fmap.free == 0) {
+        release(&fmap.lock);
+        return 0;
+    }
+    if (goal >= 2 && goal < nclus && !fmap_test(goal)) {
+        start = goal;
+    } else {
+        uint32 w = fmap.hint / 64;
+        for (uint32 i = 0; i <= nword && start == 0; i++, w = (w + 1) % nword) {
+            uint64 word = fmap.map[w / (BITS_PER_PAGE / 64)][w % (BITS_PER_PAGE / 64)];
+            if (word == ~0UL)
+                continue;
+            for (uint32 clus = w * 64; clus < w * 64 + 64; clus++) {
+                if (clus < nclus && !fmap_test(clus)) {
+                    start = clus;
+                    break;
+                }
+            }
+        }
+        if (start == 0)
+            panic("fmap_alloc: free count");
+    }
+    uint32 n = 0;
+    while (n < want && start + n < nclus && !fmap_test(start + n)) {
+        fmap_set(start + n);
+        n++;
+    }
+    fmap.free -= n;
+    fmap.hint = start + n < nclus ? start + n : 2;
+    fmap.dirty = 1;
+    release(&fmap.lock);
+    *got = n;
+    return start;
+}
+
+static void fmap_free(uint32 clus)
+{
+    acquire(&fmap.lock);
+    if (!fmap_test(clus))
+        panic("fmap_free");
+    fmap_clear(clus);
+    fmap.free++;
+    fmap.dirty = 1;
+    release(&fmap.lock);
+}
+
 static void zero_clus(uint32 cluster)
 {
     uint32 sec = first_sec_of_clus(cluster);
@@ -210,65 +563,181 @@ static void zero_clus(uint32 cluster)
     }
 }
 
-static uint32 alloc_clus(uint8 dev)
+/**
+ * Link a run of clusters into one chain with a single pass over the FAT cache.
+ * @param   prev        the cluster to link the run after, 0 if none
+ * @param   start       first cluster of the run
+ * @param   cnt         length of the run, the last one gets the EOC mark
+ */
+static void link_run(uint32 prev, uint32 start, uint32 cnt)
 {
-    // should we keep a free cluster list? instead of searching fat every time.
-    struct buf *b;
-    uint32 sec = fat.bpb.rsvd_sec_cnt;
-    uint32 const ent_per_sec = fat.bpb.byts_per_sec / sizeof(uint32);
-    for (uint32 i = 0; i < fat.bpb.fat_sz; i++, sec++) {
-        b = bread(dev, sec);
-        for (uint32 j = 0; j < ent_per_sec; j++) {
-            if (((uint32 *)(b->data))[j] == 0) {
-                ((uint32 *)(b->data))[j] = FAT32_EOC + 7;
-                bwrite(b);
-                brelse(b);
-                uint32 clus = i * ent_per_sec + j;
-                zero_clus(clus);
-                return clus;
-            }
+    if (prev)
+        write_fat(prev, start);
+    struct fat_page *fp = NULL;
+    for (uint32 clus = start; clus < start + cnt; clus++) {
+        if (fp == NULL || fp->pageno != clus / FAT_PER_PAGE) {
+            if (fp)
+                fat_put(fp);
+            fp = fat_get(clus / FAT_PER_PAGE);
         }
-        brelse(b);
+        uint32 j = clus % FAT_PER_PAGE;
+        fp->ents[j] = clus + 1 < start + cnt ? clus + 1 : FAT32_EOC + 7;
+        fp->dirty |= 1 << j / (BSIZE / sizeof(uint32));
     }
-    panic("no clusters");
+    if (fp)
+        fat_put(fp);
+}
+
+static uint32 alloc_clus(uint8 dev)
+{
+    uint32 got;
+    uint32 clus = fmap_alloc(0, 1, &got);
+    if (clus == 0)
+        panic("no clusters");
+    link_run(0, clus, 1);
+    zero_clus(clus);
+    return clus;
 }
 
 static void free_clus(uint32 cluster)
 {
     write_fat(cluster, 0);
+    fmap_free(cluster);
 }
 
+/**
+ * Copy n bytes between a cluster and a buffer, moving up to DISK_VEC_MAX
+ * sectors per device request.
+ */
 static uint rw_clus(uint32 cluster, int write, int user, uint64 data, uint off, uint n)
 {
     if (off + n > fat.byts_per_clus)
         panic("offset out of range");
     uint tot, m;
-    struct buf *bp;
+    struct buf *bufs[DISK_VEC_MAX];
     uint sec = first_sec_of_clus(cluster) + off / fat.bpb.byts_per_sec;
     off = off % fat.bpb.byts_per_sec;
 
     int bad = 0;
-    for (tot = 0; tot < n; tot += m, off += m, data += m, sec++) {
-        bp = bread(0, sec);
-        m = BSIZE - off % BSIZE;
-        if (n - tot < m) {
-            m = n - tot;
+    for (tot = 0; tot < n && bad != -1; ) {
+        int nsec = (off + n - tot + BSIZE - 1) / BSIZE;
+        if (nsec > DISK_VEC_MAX) {
+            nsec = DISK_VEC_MAX;
         }
-        if (write) {
-            if ((bad = either_copyin(bp->data + (off % BSIZE), user, data, m)) != -1) {
-                bwrite(bp);
+        breadn(0, sec, nsec, bufs);
+        int i;
+        for (i = 0; i < nsec; i++) {
+            m = BSIZE - off;
+            if (n - tot < m) {
+                m = n - tot;
             }
-        } else {
-            bad = either_copyout(user, data, bp->data + (off % BSIZE), m);
+            if (write) {
+                bad = either_copyin(bufs[i]->data + off, user, data, m);
+            } else {
+                bad = either_copyout(user, data, bufs[i]->data + off, m);
+            }
+            if (bad == -1) {
+                break;
+            }
+            tot += m;
+            data += m;
+            off = 0;
         }
-        brelse(bp);
-        if (bad == -1) {
-            break;
+        if (write && i > 0) {
+            bwriten(bufs, i);
         }
+        for (int j = 0; j < nsec; j++) {
+            brelse(bufs[j]);
+        }
+        sec += nsec;
     }
     return tot;
 }
 
+static void emap_free(struct dirent *entry)
+{
+    if (entry->emap) {
+        kfree(entry->emap);
+        entry->emap = NULL;
+    }
+    entry->emap_cnt = 0;
+    entry->emap_clus = 0;
+}
+
+/**
+ * Walk the whole cluster chain once and record it as extents.
+ * If the chain has more than EMAP_MAX runs, only a prefix is mapped.
+ */
+static void emap_build(struct dirent *entry)
+{
+    if (entry->first_clus < 2 || (entry->emap = kalloc()) == NULL) { return; }
+    struct extent *e = entry->emap;
+    uint n = 0;
+    uint32 lclus = 0;
+    for (uint32 clus = entry->first_clus; clus >= 2 && clus < FAT32_EOC; clus = read_fat(clus)) {
+        if (n > 0 && e[n - 1].pclus + e[n - 1].len == clus) {
+            e[n - 1].len++;
+        } else {
+            if (n == EMAP_MAX) { break; }
+            e[n].lclus = lclus;
+            e[n].pclus = clus;
+            e[n].len = 1;
+            n++;
+        }
+        lclus++;
+    }
+    entry->emap_cnt = n;
+    entry->emap_clus = lclus;
+}
+
+/**
+ * Record cnt clusters from pclus appended at index lclus of the chain.
+ * Nothing to do if the map stops short of the old end of the chain.
+ */
+static void emap_append(struct dirent *entry, uint32 lclus, uint32 pclus, uint32 cnt)
+{
+    if (entry->emap == NULL || entry->emap_clus != lclus) { return; }
+    struct extent *e = entry->emap;
+    uint n = entry->emap_cnt;
+    if (n > 0 && e[n - 1].pclus + e[n - 1].len == pclus) {
+        e[n - 1].len += cnt;
+    } else {
+        if (n == EMAP_MAX) { return; }
+        e[n].lclus = lclus;
+        e[n].pclus = pclus;
+        e[n].len = cnt;
+        entry->emap_cnt++;
+    }
+    entry->emap_clus += cnt;
+}
+
+/**
+ * Move cur_clus as close to cluster index clus_num as the extent map allows.
+ * Builds the map on the first backward seek.
+ */
+static void emap_seek(struct dirent *entry, uint clus_num)
+{
+    if (entry->emap == NULL && clus_num < entry->clus_cnt) {
+        emap_build(entry);
+    }
+    if (entry->emap_clus == 0) { return; }
+    uint target = clus_num < entry->emap_clus ? clus_num : entry->emap_clus - 1;
+    if (target <= entry->clus_cnt && clus_num >= entry->clus_cnt) { return; }  // cursor is closer
+
+    struct extent *e = entry->emap;
+    uint lo = 0, hi = entry->emap_cnt - 1;
+    while (lo < hi) {
+        uint mid = (lo + hi + 1) / 2;
+        if (e[mid].lclus <= target) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    entry->cur_clus = e[lo].pclus + (target - e[lo].lclus);
+    entry->clus_cnt = target;
+}
+
 /**
  * for the given entry, relocate the cur_clus field based on the off
  * @param   entry       modify its cur_clus field
@@ -279,12 +748,16 @@ static uint rw_clus(uint32 cluster, int write, int user, uint64 data, uint off,
 static int reloc_clus(struct dirent *entry, uint off, int alloc)
 {
     int clus_num = off / fat.byts_per_clus;
+    if (clus_num < entry->clus_cnt || clus_num > entry->clus_cnt + 1) {
+        emap_seek(entry, clus_num);
+    }
     while (clus_num > entry->clus_cnt) {
         int clus = read_fat(entry->cur_clus);
         if (clus >= FAT32_EOC) {
             if (alloc) {
                 clus = alloc_clus(entry->dev);
                 write_fat(entry->cur_clus, clus);
+                emap_append(entry, entry->clus_cnt + 1, clus, 1);
             } else {
                 entry->cur_clus = entry->first_clus;
                 entry->clus_cnt = 0;
@@ -308,6 +781,167 @@ static int reloc_clus(struct dirent *entry, uint off, int alloc)
     return off % fat.byts_per_clus;
 }
 
+/**
+ * Make sure entry has the clusters to hold [off, off + n), allocating the
+ * missing ones in contiguous runs that continue the existing chain where
+ * possible. New clusters the write covers entirely are not zeroed.
+ * Leaves cur_clus at the last cluster of the chain.
+ * Caller must hold entry->lock.
+ */
+static void eextend(struct dirent *entry, uint off, uint n)
+{
+    uint32 const need = (off + n + fat.byts_per_clus - 1) / fat.byts_per_clus;
+    uint32 tail = 0;        // last cluster of the chain
+    uint32 cnt = 0;         // clusters in the chain up to and including tail
+    if (entry->first_clus != 0) {
+        if (entry->cur_clus < 2 || entry->cur_clus >= FAT32_EOC) {
+            entry->cur_clus = entry->first_clus;
+            entry->clus_cnt = 0;
+        }
+        emap_seek(entry, need - 1);
+        tail = entry->cur_clus;
+        cnt = entry->clus_cnt + 1;
+        for (uint32 next; cnt < need && (next = read_fat(tail)) < FAT32_EOC; cnt++) {
+            tail = next;
+        }
+    }
+    while (cnt < need) {
+        uint32 got;
+        uint32 start = fmap_alloc(tail ? tail + 1 : 0, need - cnt, &got);
+        if (start == 0)
+            panic("no clusters");
+        link_run(tail, start, got);
+        emap_append(entry, cnt, start, got);
+        if (tail == 0) {
+            entry->first_clus = start;
+            entry->dirty = 1;
+        }
+        for (uint32 i = 0; i < got; i++) {
+            uint clus_off = (cnt + i) * fat.byts_per_clus;
+            if (clus_off < off || clus_off + fat.byts_per_clus > off + n) {
+                zero_clus(start + i);
+            }
+        }
+        tail = start + got - 1;
+        cnt += got;
+    }
+    if (tail) {
+        entry->cur_clus = tail;
+        entry->clus_cnt = cnt - 1;
+    }
+}
+
+/**
+ * Read ahead of a sequential reader. The window doubles on every read
+ * that starts where the last one ended, up to READAHEAD_MAX clusters,
+ * and collapses on a seek. Clusters are prefetched into the buffer cache
+ * in runs of contiguous sectors.
+ * Call after a read that ended at end, with cur_clus on its last cluster.
+ */
+static void eread_ahead(struct dirent *entry, uint start, uint end)
+{
+    if (start != entry->ra_next) {
+        entry->ra_win = 0;
+        entry->ra_end = 0;
+    } else if (entry->ra_win < READAHEAD_MAX) {
+        entry->ra_win = entry->ra_win ? entry->ra_win * 2 : 1;
+    }
+    entry->ra_next = end;
+    if (entry->ra_win == 0 || end >= entry->file_size) { return; }
+
+    uint last = (entry->file_size - 1) / fat.byts_per_clus;
+    uint from = entry->clus_cnt + 1;
+    uint to = entry->clus_cnt + entry->ra_win;
+    if (from < entry->ra_end) { from = entry->ra_end; }
+    if (to > last) { to = last; }
+    if (from > to) { return; }
+
+    uint32 clus = entry->cur_clus;
+    uint idx = entry->clus_cnt;
+    uint run = 0, cnt = 0;      // sectors waiting to be prefetched as one request
+    for (; idx < to; idx++) {
+        if ((clus = read_fat(clus)) >= FAT32_EOC) { break; }
+        if (idx + 1 < from) { continue; }
+        for (uint sec = first_sec_of_clus(clus); sec < first_sec_of_clus(clus) + fat.bpb.sec_per_clus; sec++) {
+            if (cnt > 0 && (run + cnt != sec || cnt == DISK_VEC_MAX)) {
+                bprefetch(entry->dev, run, cnt);
+                cnt = 0;
+            }
+            if (cnt++ == 0) { run = sec; }
+        }
+    }
+    if (cnt > 0) {
+        bprefetch(entry->dev, run, cnt);
+    }
+    entry->ra_end = idx + 1;
+}
+
+// Read n bytes at off straight from the clusters,
+// with read-ahead.  off + n must not pass EOF.
+static int eread_clus(struct dirent *entry, int user_dst, uint64 dst, uint off, uint n)
+{
+    uint tot, m, start = off;
+    for (tot = 0; entry->cur_clus < FAT32_EOC && tot < n; tot += m, off += m, dst += m) {
+        reloc_clus(entry, off, 0);
+        m = fat.byts_per_clus - off % fat.byts_per_clus;
+        if (n - tot < m) {
+            m = n - tot;
+        }
+        if (rw_clus(entry->cur_clus, 0, user_dst, dst, off % fat.byts_per_clus, m) != m) {
+            break;
+        }
+    }
+    if (tot > 0) {
+        eread_ahead(entry, start, off);
+    }
+    return tot;
+}
+
+// Get page pgoff of a regular file from the page cache, locked,
+// reading it in if needed.  If zero, the caller will overwrite
+// every byte the file has in the page, so it is zeroed instead.
+// Returns 0 if out of memory or on a read error.
+// Caller must hold entry->lock.
+static struct page *epage(struct dirent *entry, uint pgoff, int zero)
+{
+    struct page *pg = pget(entry, pgoff);
+    if (pg == NULL || pg->valid) {
+        return pg;
+    }
+    uint off = pgoff * PGSIZE, n = 0;
+    if (!zero && off < entry->file_size) {
+        n = entry->file_size - off < PGSIZE ? entry->file_size - off : PGSIZE;
+        if (eread_clus(entry, 0, (uint64)pg->data, off, n) != n) {
+            prelse(pg);
+            return NULL;
+        }
+    }
+    memset(pg->data + n, 0, PGSIZE - n);
+    pg->valid = 1;
+    return pg;
+}
+
+// Return the physical page holding the file's data at off,
+// page aligned and before EOF, with a reference for the caller
+// to map and eventually kfree(); 0 if out of memory.
+// Caller must hold entry->lock.
+uint64 epage_ref(struct dirent *entry, uint off)
+{
+    struct page *pg;
+    uint64 pa;
+
+    if (off % PGSIZE != 0 || off >= entry->file_size || (entry->attribute & ATTR_DIRECTORY)) {
+        return 0;
+    }
+    if ((pg = epage(entry, off / PGSIZE, 0)) == NULL) {
+        return 0;
+    }
+    pa = (uint64)pg->data;
+    kdup((void *)pa);
+    prelse(pg);
+    return pa;
+}
+
 /* like the original readi, but "reade" is odd, let alone "writee" */
 // Caller must hold entry->lock.
 int eread(struct dirent *entry, int user_dst, uint64 dst, uint off, uint n)
@@ -320,13 +954,22 @@ int eread(struct dirent *entry, int user_dst, uint64 dst, uint off, uint n)
     }
 
     uint tot, m;
-    for (tot = 0; entry->cur_clus < FAT32_EOC && tot < n; tot += m, off += m, dst += m) {
-        reloc_clus(entry, off, 0);
-        m = fat.byts_per_clus - off % fat.byts_per_clus;
+    struct page *pg;
+    for (tot = 0; tot < n; tot += m, off += m, dst += m) {
+        m = PGSIZE - off % PGSIZE;
         if (n - tot < m) {
             m = n - tot;
         }
-        if (rw_clus(entry->cur_clus, 0, user_dst, dst, off % fat.byts_per_clus, m) != m) {
+        if ((pg = epage(entry, off / PGSIZE, 0)) == NULL) {
+            // no page to spare: read around the cache.
+            if (eread_clus(entry, user_dst, dst, off, m) != m) {
+                break;
+            }
+            continue;
+        }
+        int bad = either_copyout(user_dst, dst, pg->data + off % PGSIZE, m);
+        prelse(pg);
+        if (bad == -1) {
             break;
         }
     }
@@ -340,21 +983,42 @@ int ewrite(struct dirent *entry, int user_src, uint64 src, uint off, uint n)
         || (entry->attribute & ATTR_READ_ONLY)) {
         return -1;
     }
-    if (entry->first_clus == 0) {   // so file_size if 0 too, which requests off == 0
-        entry->cur_clus = entry->first_clus = alloc_clus(entry->dev);
-        entry->clus_cnt = 0;
-        entry->dirty = 1;
+    if (n > 0) {                    // if first_clus is 0, so is file_size, which requests off == 0
+        eextend(entry, off, n);
     }
     uint tot, m;
+    struct page *pg;
     for (tot = 0; tot < n; tot += m, off += m, src += m) {
         reloc_clus(entry, off, 1);
         m = fat.byts_per_clus - off % fat.byts_per_clus;
         if (n - tot < m) {
             m = n - tot;
         }
-        if (rw_clus(entry->cur_clus, 1, user_src, src, off % fat.byts_per_clus, m) != m) {
+        if (PGSIZE - off % PGSIZE < m) {
+            m = PGSIZE - off % PGSIZE;
+        }
+        // Write into the cached page, then through it to the clusters.
+        // The page needn't be read if this covers all the file has there.
+        uint pgstart = off - off % PGSIZE;
+        pg = NULL;
+        if (!(entry->attribute & ATTR_DIRECTORY)) {
+            pg = epage(entry, off / PGSIZE, pgstart >= entry->file_size
+                       || (off == pgstart && off + m >= entry->file_size) || m == PGSIZE);
+        }
+        if (pg == NULL) {
+            if (rw_clus(entry->cur_clus, 1, user_src, src, off % fat.byts_per_clus, m) != m) {
+                break;
+            }
+            continue;
+        }
+        char *p = pg->data + off % PGSIZE;
+        if (either_copyin(p, user_src, src, m) == -1
+            || rw_clus(entry->cur_clus, 1, 0, (uint64)p, off % fat.byts_per_clus, m) != m) {
+            pg->valid = 0;          // read it again from disk
+            prelse(pg);
             break;
         }
+        prelse(pg);
     }
     if(n > 0) {
         if(off > entry->file_size) {
@@ -389,17 +1053,25 @@ static struct dirent *eget(struct dirent *parent, char *name)
     }
     for (ep = root.prev; ep != &root; ep = ep->prev) {              // LRU algo
         if (ep->ref == 0) {
-            ep->ref = 1;
-            ep->dev = parent->dev;
-            ep->off = 0;
-            ep->valid = 0;
-            ep->dirty = 0;
-            release(&ecache.lock);
-            return ep;
+            break;
         }
     }
-    panic("eget: insufficient ecache");
-    return 0;
+    if (ep == &root) {          // all in use, grow the cache
+        ep = enew();
+    }
+    if (ep == NULL) {
+        panic("eget: insufficient ecache");
+    }
+    ep->ref = 1;
+    pinval(ep);
+    emap_free(ep);
+    ep->ra_next = ep->ra_win = ep->ra_end = 0;
+    ep->dev = parent->dev;
+    ep->off = 0;
+    ep->valid = 0;
+    ep->dirty = 0;
+    release(&ecache.lock);
+    return ep;
 }
 
 // trim ' ' in the head and tail, '.' in head, and test legality
@@ -639,11 +1311,13 @@ void eremove(struct dirent *entry)
 // caller must hold entry->lock
 void etrunc(struct dirent *entry)
 {
+    pinval(entry);
     for (uint32 clus = entry->first_clus; clus >= 2 && clus < FAT32_EOC; ) {
         uint32 next = read_fat(clus);
         free_clus(clus);
         clus = next;
     }
+    emap_free(entry);
     entry->file_size = 0;
     entry->first_clus = 0;
     entry->dirty = 1;
@@ -16,21 +16,21 @@
 #include "include/printf.h"
 #include "include/string.h"
 #include "include/vm.h"
+#include "include/slab.h"
 
 struct devsw devsw[NDEV];
+// Open files come from an object cache; the lock
+// only guards their reference counts.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  struct kmem_cache *cache;
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
-  struct file *f;
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    memset(f, 0, sizeof(struct file));
-  }
+  ftable.cache = kmem_cache_create("file", sizeof(struct file));
   #ifdef DEBUG
   printf("fileinit\n");
   #endif
@@ -42,16 +42,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return NULL;
+  if((f = kmem_cache_alloc(ftable.cache)) == NULL)
+    return NULL;
+  memset(f, 0, sizeof(struct file));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -83,6 +78,7 @@ fileclose(struct file *f)
   f->ref = 0;
   f->type = FD_NONE;
   release(&ftable.lock);
+  kmem_cache_free(ftable.cache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -122,6 +118,8 @@ fileread(struct file *f, uint64 addr, int n)
 
   if(f->readable == 0)
     return -1;
+  if(vma_prefault(myproc(), addr, n, 1) < 0)
+    return -1;
 
   switch (f->type) {
     case FD_PIPE:
@@ -154,6 +152,8 @@ filewrite(struct file *f, uint64 addr, int n)
 
   if(f->writable == 0)
     return -1;
+  if(vma_prefault(myproc(), addr, n, 0) < 0)
+    return -1;
 
   if(f->type == FD_PIPE){
     ret = pipewrite(f->pipe, addr, n);
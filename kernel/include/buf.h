@@ -12,14 +12,24 @@ struct buf {
   uint sectorno;	// sector number 
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev;
+  int bucket;		// hash bucket index, -1 if not hashed
+  struct buf *hnext;	// hash chain
+  struct buf *prev;	// LRU free list
   struct buf *next;
-  uchar data[BSIZE];
+  int dirty;		// modified since it was read or last written back
+  uint dirtytick;	// when it became dirty
+  uchar *data;		// BSIZE bytes, inside a page owned by bcache
 };
 
 void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            breadn(uint, uint, int, struct buf**);
+void            bwriten(struct buf**, int);
+void            bprefetch(uint, uint, int);
+void            bflush(int);
+void            bflusher(void);
+int             breclaim(void);
 
 #endif
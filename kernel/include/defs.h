@@ -17,6 +17,11 @@ void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            breadn(uint, uint, int, struct buf**);
+void            bwriten(struct buf**, int);
+void            bprefetch(uint, uint, int);
+void            bflush(int);
+void            bflusher(void);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
 
@@ -34,6 +39,9 @@ void timer_tick();
 void            disk_init(void);
 void            disk_read(struct buf *b);
 void            disk_write(struct buf *b);
+void            disk_rw_vec(struct buf **bufs, int n, int write);
+void            disk_submit(struct buf **bufs, int n, int write, void (*done)(struct buf **, int));
+void            disk_wait(struct buf *b);
 void            disk_intr(void);
 
 // exec.c
@@ -41,6 +49,8 @@ int             exec(char*, char**);
 
 // fat32.c
 int             fat32_init(void);
+void            fat_flush(void);
+void            fat32_sync(void);
 struct dirent*  dirlookup(struct dirent *entry, char *filename, uint *poff);
 struct dirent*  ealloc(struct dirent *dp, char *name, int dir);
 struct dirent*  edup(struct dirent *entry);
@@ -88,6 +98,13 @@ int             dirnext(struct file *f, uint64 addr);
 
 // kalloc.c
 void*           kalloc(void);
+void*           kalloc_zeroed(void);
+void*           kalloc_pages(int order);
+void            kfree_pages(void *pa, int order);
+void            kdup(void *);
+int             kshared(void *);
+void            kmemdump(void);
+int             kzero_idle(void);
 void            kfree(void *);
 void            kinit(void);
 uint64          freemem_amount(void);
@@ -99,6 +116,7 @@ uint64          freemem_amount(void);
 // void            end_op(void);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -128,6 +146,7 @@ void            sched(void);
 void            setproc(struct proc*);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
+int             kthread_create(void (*fn)(void), char *name);
 int             wait(uint64);
 void            wakeup(void*);
 void            yield(void);
@@ -215,6 +234,9 @@ int             copyinstr(pagetable_t, char *, uint64, uint64);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *b, int write);
+void            virtio_disk_rw_vec(struct buf **bufs, int n, int write);
+void            virtio_disk_submit(struct buf **bufs, int n, int write, void (*done)(struct buf **, int));
+void            virtio_disk_wait(struct buf *b);
 void            virtio_disk_intr(void);
 
 // plic.c
@@ -6,6 +6,9 @@
 void disk_init(void);
 void disk_read(struct buf *b);
 void disk_write(struct buf *b);
+void disk_rw_vec(struct buf **bufs, int n, int write);
+void disk_submit(struct buf **bufs, int n, int write, void (*done)(struct buf **, int));
+void disk_wait(struct buf *b);
 void disk_intr(void);
 
 #endif
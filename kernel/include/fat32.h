@@ -22,6 +22,21 @@
 #define FAT32_MAX_FILENAME  255
 #define FAT32_MAX_PATH      260
 #define ENTRY_CACHE_NUM     50
+#define FATCACHE_NUM        32      // pages of FAT kept in memory
+#define FREEMAP_PAGES       128     // free-cluster bitmap pages, 32K clusters each
+#define READAHEAD_MAX       32      // most clusters read ahead of a sequential reader
+
+#define FSI_LEAD_SIG        0x41615252
+#define FSI_STRUC_SIG       0x61417272
+
+// a run of physically contiguous clusters in a file
+struct extent {
+    uint32  lclus;          // index of the first cluster in the file
+    uint32  pclus;          // its cluster number on disk
+    uint32  len;
+};
+
+#define EMAP_MAX            (PGSIZE / sizeof(struct extent))
 
 struct dirent {
     char  filename[FAT32_MAX_FILENAME + 1];
@@ -37,6 +52,13 @@ struct dirent {
 
     uint32  cur_clus;  // 当前簇。用于读写时的缓存，记录当前操作到了哪个簇。
     uint    clus_cnt;
+    struct extent *emap;    // cluster chain in runs, built on the first backward seek
+    uint    emap_cnt;       // count of extents in emap
+    uint    emap_clus;      // count of leading clusters emap covers
+    uint    ra_next;        // where a sequential reader would read next
+    uint    ra_win;         // read-ahead window in clusters, 0 if not sequential
+    uint    ra_end;         // clusters before this index have been read ahead
+    uint    npage;          // pages in the page cache (pcache.c)
 
     /* for OS */
     uint8   dev;
@@ -51,6 +73,8 @@ struct dirent {
 };
 
 int             fat32_init(void);
+void            fat_flush(void);
+void            fat32_sync(void);
 struct dirent*  dirlookup(struct dirent *entry, char *filename, uint *poff);
 char*           formatname(char *name);
 void            emake(struct dirent *dp, struct dirent *ep, uint off);
@@ -68,6 +92,7 @@ struct dirent*  ename(char *path);
 struct dirent*  enameparent(char *path, char *name);
 int             eread(struct dirent *entry, int user_dst, uint64 dst, uint off, uint n);
 int             ewrite(struct dirent *entry, int user_src, uint64 src, uint off, uint n);
+uint64          epage_ref(struct dirent *entry, uint off);
 struct dirent* ename_env(struct dirent *env, char *path);
 struct dirent* enameparent_env(struct dirent *env, char *path, char *name);
 #endif
\ No newline at end of file
@@ -12,4 +12,14 @@
 // 告诉内核，如果提供的路径是相对路径，请相对于当前工作目录（Current Working Directory）来查找，
 // 而不是相对于某个特定的文件描述符。
 #define AT_FDCWD  -100
-#define AT_REMOVEDIR 0x200
\ No newline at end of file
+#define AT_REMOVEDIR 0x200
+
+// mmap() protection and flags, as in Linux.
+#define PROT_NONE     0x0
+#define PROT_READ     0x1
+#define PROT_WRITE    0x2
+#define PROT_EXEC     0x4
+#define MAP_SHARED    0x01
+#define MAP_PRIVATE   0x02
+#define MAP_FIXED     0x10
+#define MAP_ANONYMOUS 0x20
@@ -4,6 +4,13 @@
 #include "types.h"
 
 void*           kalloc(void);
+void*           kalloc_zeroed(void);
+int             kzero_idle(void);
+void*           kalloc_pages(int order);
+void            kfree_pages(void *pa, int order);
+void            kdup(void *);
+int             kshared(void *);
+void            kmemdump(void);
 void            kfree(void *);
 void            kinit(void);
 uint64          freemem_amount(void);
@@ -108,10 +108,10 @@
 // in both user and kernel space.
 #define TRAMPOLINE              (MAXVA - PGSIZE)
 
-// map kernel stacks beneath the trampoline,
+// map kernel stacks beneath the devices,
 // each surrounded by invalid guard pages.
-// #define KSTACK(p)               (TRAMPOLINE - ((p) + 1) * 2 * PGSIZE)
 #define VKSTACK                 0x3EC0000000L
+#define KSTACK(p)               (VKSTACK + ((p) * 2 + 1) * PGSIZE)
 
 // User memory layout.
 // Address zero first:
@@ -120,10 +120,16 @@
 //   fixed-size stack
 //   expandable heap
 //   ...
+//   mmap() regions, top-down from MMAPTOP to MMAPBASE
+//   ...
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME               (TRAMPOLINE - PGSIZE)
 
 #define MAXUVA                  RUSTSBI_BASE
 
+// the heap may not grow past MMAPBASE.
+#define MMAPBASE                0x40000000L
+#define MMAPTOP                 MAXUVA
+
 #endif
@@ -3,15 +3,30 @@
 
 #define NPROC        50  // maximum number of processes
 #define NCPU          2  // maximum number of CPUs
+#define KMAG_MAX     64  // free pages a CPU keeps before draining to the global list
+#define KBATCH       32  // pages moved per magazine refill or drain
+#define KMAXORDER    10  // largest physically contiguous block is 2^KMAXORDER pages
+#define ZPOOL_MAX    64  // pre-zeroed pages kept for kalloc_zeroed()
+#define ZPOOL_BATCH  4   // pages zeroed per idle pass of the scheduler
+#define ZPOOL_RESERVE 256  // don't pre-zero when fewer free pages than this
+#define NVMA         16  // mmap() regions per process
 #define NOFILE       128  // 从 16 改为 128，以支持 dup2 到 fd 100
-#define NFILE       100  // open files per system
+#define NKCACHE      16  // object caches (slab.c)
 #define NINODE      500   //从 100 增加到 500，避免系统文件表满了
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define NBUF         32  // initial (and minimum) size of disk block cache
+#define NBUF_MAX     1024  // disk block cache may grow up to this many blocks
+#define BCACHE_RESERVE 128  // don't grow the block cache below this many free pages
+#define PCACHE_RESERVE 128  // recycle file pages rather than grow the page cache below this many free pages
+#define NBUCKET      31  // hash buckets of disk block cache
+#define DISK_VEC_MAX 8   // max sectors moved by one disk request
+#define BFLUSH_BATCH 32  // dirty buffers sorted and written per pass
+#define BFLUSH_AGE   50  // ticks a buffer may stay dirty before write-back
+#define BFLUSH_INTERVAL 10  // ticks between passes of the flusher thread
 #define FSSIZE       1000  // size of file system in blocks
 #define MAXPATH      260   // maximum file path name
 #define INTERVAL     (390000000 / 200) // timer interrupt interval
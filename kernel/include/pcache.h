@@ -0,0 +1,28 @@
+#ifndef __PCACHE_H
+#define __PCACHE_H
+
+#include "types.h"
+#include "sleeplock.h"
+
+struct dirent;
+
+// A page of a regular file, cached by (dirent, page index).
+struct page {
+  struct dirent *ep;
+  uint pgoff;               // page index in the file
+  int ref;                  // holders from pget()
+  int valid;                // data matches the file
+  char *data;               // from kalloc(); mappings take kdup() references
+  struct sleeplock lock;    // protects valid and data
+  struct page *hnext;       // hash chain
+  struct page *prev;        // LRU list, most recently used first
+  struct page *next;
+};
+
+void            pcacheinit(void);
+struct page*    pget(struct dirent *ep, uint pgoff);
+void            prelse(struct page *pg);
+void            pinval(struct dirent *ep);
+int             preclaim(void);
+
+#endif
@@ -16,6 +16,7 @@ struct pipe {
   int writeopen;  // write fd is still open
 };
 
+void pipeinit(void);
 int pipealloc(struct file **f0, struct file **f1);
 void pipeclose(struct pipe *pi, int writable);
 int pipewrite(struct pipe *pi, uint64 addr, int n);
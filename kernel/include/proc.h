@@ -8,6 +8,7 @@
 #include "file.h"
 #include "fat32.h"
 #include "trap.h"
+#include "vma.h"
 
 // Saved registers for kernel context switches.
 struct context {
@@ -39,6 +40,15 @@ struct cpu {
 
 extern struct cpu cpus[NCPU];
 
+struct waitq;
+
+// Scheduling policies, as in Linux.
+#define SCHED_NORMAL  0
+#define SCHED_FIFO    1
+
+// setpriority() and getpriority() targets.
+#define PRIO_PROCESS  0
+
 enum procstate { UNUSED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -49,27 +59,41 @@ struct proc {
   enum procstate state;        // Process state
   struct proc *parent;         // Parent process
   void *chan;                  // If non-zero, sleeping on chan
+  struct waitq *wq;            // Wait queue of chan, if on it
+  struct proc *wqnext;         // Next on the wait queue
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // Hart it last ran on, whose run queue it joins
+  struct proc *rqnext;         // Next on the SCHED_FIFO run queue
+  int onrq;                    // On a run queue (that queue's lock)
+  int policy;                  // SCHED_NORMAL or SCHED_FIFO
+  int nice;                    // -20 to 19, for SCHED_NORMAL
+  int rtprio;                  // 1 to 99, for SCHED_FIFO
+  uint64 vruntime;             // Virtual run time, for SCHED_NORMAL
+  uint64 runstart;             // r_time() when it started running
   
   // ADD THESE FOUR LINES FOR TIME KEEPING
-  uint64 utime;                // User time in ticks
-  uint64 stime;                // System (kernel) time in ticks
+  uint64 utime;                // User time, in r_time() units
+  uint64 stime;                // System (kernel) time, in r_time() units
   uint64 cutime;               // Children's user time
   uint64 cstime;               // Children's system time
+  uint64 tstamp;               // r_time() when utime or stime was last charged
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
   uint64 sz;                   // Size of process memory (bytes)
-  pagetable_t pagetable;       // User page table
-  pagetable_t kpagetable;      // Kernel page table
+  pagetable_t pagetable;       // Page table, user and kernel
+  int asid;                    // Address space ID of pagetable, 0 if none
+  uint64 tlbstale;             // Harts that must flush asid before running it
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
+  struct vma vma[NVMA];        // mmap() regions
   struct file *ofile[NOFILE];  // Open files
   struct dirent *cwd;          // Current directory
   char name[16];               // Process name (debugging)
   int tmask;                    // trace mask
+  void (*kfn)(void);           // body of a kernel thread, 0 for user processes
 };
 
 void            reg_info(void);
@@ -89,9 +113,14 @@ void            sched(void);
 void            setproc(struct proc*);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
+int             kthread_create(void (*fn)(void), char *name);
 int             wait(uint64,int);
 void            wakeup(void*);
 void            yield(void);
+void            preempt(void);
+int             setnice(int pid, int nice);
+int             getnice(int pid, int *nice);
+int             setscheduler(int pid, int policy, int prio);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
@@ -43,6 +43,7 @@ w_mepc(uint64 x)
 
 // Supervisor Status Register, sstatus
 
+#define SSTATUS_SUM (1L << 18) // Supervisor may access User memory (PUM, inverted, before priv 1.10)
 #define SSTATUS_SPP (1L << 8)  // Previous mode, 1=Supervisor, 0=User
 #define SSTATUS_SPIE (1L << 5) // Supervisor Previous Interrupt Enable
 #define SSTATUS_UPIE (1L << 4) // User Previous Interrupt Enable
@@ -188,6 +189,7 @@ w_mtvec(uint64 x)
 #define SATP_SV39 (8L << 60)
 
 #define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12))
+#define SATP_ASID(asid) (((uint64)(asid)) << 44)
 
 // supervisor address translation and protection;
 // holds the address of the page table.
@@ -333,6 +335,14 @@ sfence_vma()
   asm volatile("sfence.vma");
 }
 
+// flush the TLB entries of one address space,
+// except global ones.
+static inline void
+sfence_vma_asid(uint64 asid)
+{
+  asm volatile("sfence.vma zero, %0" : : "r" (asid));
+}
+
 
 #define PGSIZE 4096 // bytes per page
 #define PGSHIFT 12  // bits of offset within a page
@@ -345,6 +355,10 @@ sfence_vma()
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // 1 -> user can access
+#define PTE_G (1L << 5) // global: in every address space
+#define PTE_A (1L << 6) // accessed
+#define PTE_D (1L << 7) // dirty: written since mapped
+#define PTE_COW (1L << 8) // RSW bit: shared copy-on-write
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
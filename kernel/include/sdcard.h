@@ -7,6 +7,10 @@ void sdcard_read_sector(uint8 *buf, int sectorno);
 
 void sdcard_write_sector(uint8 *buf, int sectorno);
 
+void sdcard_read_sectors(uint8 **bufs, int sectorno, int count);
+
+void sdcard_write_sectors(uint8 **bufs, int sectorno, int count);
+
 void test_sdcard(void);
 
 #endif 
@@ -0,0 +1,31 @@
+#ifndef __SLAB_H
+#define __SLAB_H
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+
+#define KSTASH      16      // objects a CPU keeps for itself per cache
+
+struct slab;
+
+// A cache of equally sized objects, carved out of whole pages.
+struct kmem_cache {
+  char name[16];
+  uint size;                  // object size, rounded up
+  uint perslab;               // objects in one page
+  struct spinlock lock;
+  struct slab *partial;       // slabs with free objects, through next/prev
+  int nslab;                  // pages in use
+  int nempty;                 // slabs on the partial list with no object in use
+  struct {
+    void *obj[KSTASH];
+    int n;
+  } stash[NCPU];              // per-CPU, touched with interrupts off
+};
+
+struct kmem_cache*  kmem_cache_create(char *name, uint size);
+void*               kmem_cache_alloc(struct kmem_cache *c);
+void                kmem_cache_free(struct kmem_cache *c, void *obj);
+
+#endif
@@ -47,4 +47,9 @@
 #define SYS_unlink      35
 #define SYS_umount      39
 #define SYS_mount       40
+#define SYS_sync        81
+#define SYS_fsync       82
+#define SYS_sched_setscheduler 119
+#define SYS_setpriority 140
+#define SYS_getpriority 141
 #endif
\ No newline at end of file
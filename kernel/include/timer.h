@@ -4,11 +4,18 @@
 #include "types.h"
 #include "spinlock.h"
 
-extern struct spinlock tickslock;
-extern uint ticks;
+// r_time() counts per second.
+#ifdef QEMU
+#define TIMEBASE     10000000
+#else
+#define TIMEBASE     (390000000 / 50)
+#endif
 
 void timerinit();
 void set_next_timeout();
-void timer_tick();
+int timer_tick();
+void timer_idle(void);
+uint timer_ticks(void);
+int timer_sleep(uint64 when);
 
 #endif
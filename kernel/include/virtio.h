@@ -51,7 +51,7 @@
 
 // this many virtio descriptors.
 // must be a power of two.
-#define NUM 8
+#define NUM 64
 
 struct VRingDesc {
   uint64 addr;
@@ -79,6 +79,9 @@ struct UsedArea {
 
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *b, int write);
+void            virtio_disk_rw_vec(struct buf **bufs, int n, int write);
+void            virtio_disk_submit(struct buf **bufs, int n, int write, void (*done)(struct buf **, int));
+void            virtio_disk_wait(struct buf *b);
 void            virtio_disk_intr(void);
 
 #endif
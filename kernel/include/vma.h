@@ -0,0 +1,31 @@
+#ifndef __VMA_H
+#define __VMA_H
+
+#include "types.h"
+
+struct proc;
+struct file;
+
+// A region mapped by mmap(), or a program segment
+// mapped by exec(), page aligned.
+// Pages are faulted in by vma_fault().
+struct vma {
+  uint64 start;
+  uint64 end;               // 0 if the slot is free
+  int prot;                 // PROT_*
+  int flags;                // MAP_*
+  struct file *f;           // 0 for MAP_ANONYMOUS
+  uint64 off;               // file offset of start
+  uint64 fsize;             // bytes from the file; the rest reads as zeros
+};
+
+struct vma*     vma_find(struct proc *p, uint64 va);
+uint64          vma_map(struct proc *p, uint64 addr, uint64 len, int prot, int flags,
+                        struct file *f, uint64 off);
+int             vma_unmap(struct proc *p, uint64 addr, uint64 len);
+int             vma_fault(struct proc *p, uint64 va, int write);
+int             vma_prefault(struct proc *p, uint64 va, uint64 len, int write);
+int             vma_fork(struct proc *p, struct proc *np);
+void            vma_exit(struct proc *p);
+
+#endif
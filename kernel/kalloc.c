@@ -1,6 +1,22 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or blocks of 2^order physically contiguous pages.
+//
+// Free memory is kept by a buddy allocator: kmem.free[o] lists
+// free blocks of 2^o pages, aligned to their size counting from
+// KERNBASE.  A freed block is merged with its buddy whenever the
+// buddy is free too.
+//
+// Each CPU keeps a small magazine of free pages under its own
+// lock, so the usual kalloc()/kfree() touches nothing shared.
+// Magazines refill from and drain to the global list KBATCH
+// pages at a time; a CPU that finds both its magazine and the
+// global list empty steals half of another CPU's magazine.
+//
+// Pages are not filled with junk unless the kernel is built with
+// KALLOC_JUNK (make junk=1).  kalloc_zeroed() hands out pages from
+// a pool that the scheduler fills with zeroed pages while idle.
 
 
 #include "include/types.h"
@@ -11,27 +27,146 @@
 #include "include/kalloc.h"
 #include "include/string.h"
 #include "include/printf.h"
+#include "include/buf.h"
+#include "include/pcache.h"
+#include "include/intr.h"
+#include "include/proc.h"
 
 void freerange(void *pa_start, void *pa_end);
 
 extern char kernel_end[]; // first address after kernel.
 
+#define NPHYSPAGE   ((PHYSTOP - KERNBASE) / PGSIZE)
+#define PA2IDX(pa)  (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define IDX2PA(i)   ((struct run*)(KERNBASE + (uint64)(i) * PGSIZE))
+
+// prev is only used on the buddy lists.
 struct run {
   struct run *next;
+  struct run *prev;
 };
 
 struct {
   struct spinlock lock;
-  struct run *freelist;
-  uint64 npage;
+  struct run free[KMAXORDER + 1];     // list heads
+  int nfree[KMAXORDER + 1];           // blocks on each list
+  uint64 npage;                       // pages on all lists
+  // For the first page of each free block, PG_FREE | its order;
+  // 0 for every other page.
+  uint8 state[NPHYSPAGE];
 } kmem;
 
+#define PG_FREE     0x80
+
+struct kcpu {
+  struct spinlock lock;
+  struct run *freelist;
+  int npage;
+} __attribute__((aligned(64))) kcpu[NCPU];   // one cache line each
+
+// Pages zeroed ahead of time for kalloc_zeroed().
+// They count as free memory and are handed back under pressure.
+struct {
+  struct spinlock lock;
+  struct run *freelist;
+  int npage;
+} zpool;
+
+// Extra owners of a page shared by copy-on-write fork.
+// 0 means the page has one owner, so only a page's owners
+// can see a non-zero count, and the one that sees 0 in
+// kfree() is the last.
+struct {
+  struct spinlock lock;
+  uint16 cnt[NPHYSPAGE];   // a page cache page may be mapped NVMA times by each of NPROC processes
+} kref;
+
+static void
+list_push(struct run *head, struct run *r)
+{
+  r->next = head->next;
+  r->prev = head;
+  head->next->prev = r;
+  head->next = r;
+}
+
+static void
+list_remove(struct run *r)
+{
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+}
+
+// Put a block of 2^order pages back, merging it with
+// its buddy as far as possible.  Caller holds kmem.lock.
+static void
+buddy_free(uint64 idx, int order)
+{
+  uint64 buddy;
+
+  kmem.npage += 1UL << order;
+  while(order < KMAXORDER){
+    buddy = idx ^ (1UL << order);
+    if(buddy >= NPHYSPAGE || kmem.state[buddy] != (PG_FREE | order))
+      break;
+    list_remove(IDX2PA(buddy));
+    kmem.nfree[order]--;
+    kmem.state[buddy] = 0;
+    idx &= ~(1UL << order);
+    order++;
+  }
+  kmem.state[idx] = PG_FREE | order;
+  list_push(&kmem.free[order], IDX2PA(idx));
+  kmem.nfree[order]++;
+}
+
+// Take a block of 2^order pages, splitting a larger one
+// if need be.  Caller holds kmem.lock.
+static struct run*
+buddy_alloc(int order)
+{
+  struct run *r;
+  uint64 idx;
+  int o;
+
+  for(o = order; o <= KMAXORDER && kmem.nfree[o] == 0; o++)
+    ;
+  if(o > KMAXORDER)
+    return 0;
+  r = kmem.free[o].next;
+  list_remove(r);
+  kmem.nfree[o]--;
+  idx = PA2IDX(r);
+  kmem.state[idx] = 0;
+  // Give back the upper halves.
+  while(o > order){
+    o--;
+    kmem.state[idx + (1UL << o)] = PG_FREE | o;
+    list_push(&kmem.free[o], IDX2PA(idx + (1UL << o)));
+    kmem.nfree[o]++;
+  }
+  kmem.npage -= 1UL << order;
+  return r;
+}
+
 void
 kinit()
 {
   initlock(&kmem.lock, "kmem");
-  kmem.freelist = 0;
+  for(int o = 0; o <= KMAXORDER; o++){
+    kmem.free[o].next = kmem.free[o].prev = &kmem.free[o];
+    kmem.nfree[o] = 0;
+  }
   kmem.npage = 0;
+  for(int i = 0; i < NCPU; i++){
+    initlock(&kcpu[i].lock, "kmem_cpu");
+    kcpu[i].freelist = 0;
+    kcpu[i].npage = 0;
+  }
+  initlock(&kref.lock, "kref");
+  initlock(&zpool.lock, "zpool");
+  zpool.freelist = 0;
+  zpool.npage = 0;
   freerange(kernel_end, (void*)PHYSTOP);
   #ifdef DEBUG
   printf("kernel_end: %p, phystop: %p\n", kernel_end, (void*)PHYSTOP);
@@ -44,8 +179,40 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
+  acquire(&kmem.lock);
   for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+    buddy_free(PA2IDX(p), 0);
+  release(&kmem.lock);
+}
+
+// Lock and return this CPU's magazine.
+static struct kcpu*
+mykcpu(void)
+{
+  struct kcpu *c;
+
+  push_off();
+  c = &kcpu[cpuid()];
+  acquire(&c->lock);    // keeps interrupts off, so we stay on this CPU
+  pop_off();
+  return c;
+}
+
+// Move up to n pages from the head of *from to the head of *to,
+// as singly linked lists.
+// Returns how many were moved.
+static int
+kmove(struct run **from, struct run **to, int n)
+{
+  struct run *r;
+  int i;
+
+  for(i = 0; i < n && (r = *from) != 0; i++){
+    *from = r->next;
+    r->next = *to;
+    *to = r;
+  }
+  return i;
 }
 
 // Free the page of physical memory pointed at by v,
@@ -56,20 +223,109 @@ void
 kfree(void *pa)
 {
   struct run *r;
+  struct kcpu *c;
+  int n;
   
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < kernel_end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  if(kref.cnt[PA2IDX(pa)]){
+    acquire(&kref.lock);
+    if(kref.cnt[PA2IDX(pa)]){
+      kref.cnt[PA2IDX(pa)]--;
+      release(&kref.lock);
+      return;
+    }
+    release(&kref.lock);
+  }
+
+  #ifdef KALLOC_JUNK
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+  #endif
 
   r = (struct run*)pa;
 
+  c = mykcpu();
+  r->next = c->freelist;
+  c->freelist = r;
+  c->npage++;
+  if(c->npage > KMAG_MAX){
+    // Drain a batch to the buddy lists.
+    acquire(&kmem.lock);
+    for(n = 0; n < KBATCH && (r = c->freelist) != 0; n++){
+      c->freelist = r->next;
+      buddy_free(PA2IDX(r), 0);
+    }
+    c->npage -= n;
+    release(&kmem.lock);
+  }
+  release(&c->lock);
+}
+
+// Refill c, which is locked and empty, from the buddy lists,
+// or else from another CPU's magazine.
+static void
+krefill(struct kcpu *c)
+{
+  struct run *r;
+  int n;
+
   acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  kmem.npage++;
+  for(n = 0; n < KBATCH && (r = buddy_alloc(0)) != 0; n++){
+    r->next = c->freelist;
+    c->freelist = r;
+  }
   release(&kmem.lock);
+  c->npage += n;
+  if(n > 0)
+    return;
+
+  // Never hold two magazine locks: steal into a private list first.
+  release(&c->lock);
+  struct run *stolen = 0;
+  for(struct kcpu *o = kcpu; o < kcpu + NCPU && n == 0; o++){
+    acquire(&o->lock);
+    n = kmove(&o->freelist, &stolen, (o->npage + 1) / 2);
+    o->npage -= n;
+    release(&o->lock);
+  }
+  acquire(&c->lock);
+  c->npage += kmove(&stolen, &c->freelist, n);
+}
+
+static struct run*
+zpool_get(void)
+{
+  struct run *r;
+
+  acquire(&zpool.lock);
+  r = zpool.freelist;
+  if(r){
+    zpool.freelist = r->next;
+    zpool.npage--;
+  }
+  release(&zpool.lock);
+  return r;
+}
+
+// Take a page from the magazines, without reclaiming anything.
+static struct run*
+kalloc1(void)
+{
+  struct run *r;
+  struct kcpu *c;
+
+  c = mykcpu();
+  if(c->freelist == 0)
+    krefill(c);
+  r = c->freelist;
+  if(r) {
+    c->freelist = r->next;
+    c->npage--;
+  }
+  release(&c->lock);
+  return r;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -80,21 +336,191 @@ kalloc(void)
 {
   struct run *r;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r) {
-    kmem.freelist = r->next;
-    kmem.npage--;
+  for(;;){
+    // Out of pages: use up the zeroed pool, then
+    // shrink the buffer and page caches and try again.
+    if((r = kalloc1()) || (r = zpool_get()) || !(breclaim() || preclaim()))
+      break;
   }
-  release(&kmem.lock);
 
+  #ifdef KALLOC_JUNK
   if(r)
     memset((char*)r, 5, PGSIZE); // fill with junk
+  #endif
+  return (void*)r;
+}
+
+// Allocate one page filled with zeros.
+void *
+kalloc_zeroed(void)
+{
+  struct run *r;
+
+  if((r = zpool_get()) != 0){
+    r->next = 0;    // the only word the free list wrote
+    return (void*)r;
+  }
+  if((r = kalloc()) != 0)
+    memset((char*)r, 0, PGSIZE);
   return (void*)r;
 }
 
+// Zero a few free pages into the pool.  Called by an idle
+// scheduler, so interrupts are on and no locks are held.
+// Returns the number of pages zeroed.
+int
+kzero_idle(void)
+{
+  struct run *r;
+  int n;
+
+  for(n = 0; n < ZPOOL_BATCH && zpool.npage < ZPOOL_MAX; n++){
+    if(freemem_amount() < ZPOOL_RESERVE * PGSIZE || (r = kalloc1()) == 0)
+      break;
+    memset((char*)r, 0, PGSIZE);
+    acquire(&zpool.lock);
+    r->next = zpool.freelist;
+    zpool.freelist = r;
+    zpool.npage++;
+    release(&zpool.lock);
+  }
+  return n;
+}
+
+// Give every page held in the magazines and the zeroed pool
+// back to the buddy lists, so that they can merge.
+static void
+kdrain(void)
+{
+  struct run *r, *list;
+  int n;
+
+  for(struct kcpu *c = kcpu; c < kcpu + NCPU; c++){
+    acquire(&c->lock);
+    list = c->freelist;
+    n = c->npage;
+    c->freelist = 0;
+    c->npage = 0;
+    release(&c->lock);
+    acquire(&kmem.lock);
+    for(; n > 0 && (r = list) != 0; n--){
+      list = r->next;
+      buddy_free(PA2IDX(r), 0);
+    }
+    release(&kmem.lock);
+  }
+  while((r = zpool_get()) != 0){
+    acquire(&kmem.lock);
+    buddy_free(PA2IDX(r), 0);
+    release(&kmem.lock);
+  }
+}
+
+// Allocate 2^order physically contiguous pages, aligned to
+// their size.  Returns 0 if no such block can be found.
+void *
+kalloc_pages(int order)
+{
+  struct run *r;
+
+  if(order < 0 || order > KMAXORDER)
+    return 0;
+  if(order == 0)
+    return kalloc();
+  for(int tries = 0; ; tries++){
+    acquire(&kmem.lock);
+    r = buddy_alloc(order);
+    release(&kmem.lock);
+    if(r)
+      break;
+    // Pages parked in the magazines may be what keeps
+    // blocks from merging; after that, shrink the caches.
+    // What they free goes to this CPU's magazine, so
+    // drain again each time for it to reach the buddy lists.
+    if(tries > 0 && !breclaim() && !preclaim())
+      return 0;
+    kdrain();
+  }
+  #ifdef KALLOC_JUNK
+  memset((char*)r, 5, PGSIZE << order);
+  #endif
+  return (void*)r;
+}
+
+// Free a block from kalloc_pages(order).
+void
+kfree_pages(void *pa, int order)
+{
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(order < 0 || order > KMAXORDER || (PA2IDX(pa) & ((1UL << order) - 1)) != 0
+     || (char*)pa < kernel_end || (uint64)pa + (PGSIZE << order) > PHYSTOP)
+    panic("kfree_pages");
+  #ifdef KALLOC_JUNK
+  memset(pa, 1, PGSIZE << order);
+  #endif
+  acquire(&kmem.lock);
+  buddy_free(PA2IDX(pa), order);
+  release(&kmem.lock);
+}
+
+// Take another reference to a page from kalloc(),
+// which the caller must own.  kfree() drops it.
+void
+kdup(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < kernel_end || (uint64)pa >= PHYSTOP)
+    panic("kdup");
+  acquire(&kref.lock);
+  if(kref.cnt[PA2IDX(pa)] == 0xffff)
+    panic("kdup: too many refs");
+  kref.cnt[PA2IDX(pa)]++;
+  release(&kref.lock);
+}
+
+// Does anyone other than the caller own pa?
+// Only a hint unless the other owners are held off.
+int
+kshared(void *pa)
+{
+  return kref.cnt[PA2IDX(pa)] != 0;
+}
+
+// Print how free memory is split up, to see why
+// a large allocation fails.
+void
+kmemdump(void)
+{
+  int nfree[KMAXORDER + 1];
+  int o, top = -1;
+
+  acquire(&kmem.lock);
+  for(o = 0; o <= KMAXORDER; o++){
+    nfree[o] = kmem.nfree[o];
+    if(nfree[o])
+      top = o;
+  }
+  release(&kmem.lock);
+  printf("free pages: %d (buddy %d, cpu caches", (int)(freemem_amount() >> PGSHIFT), (int)kmem.npage);
+  for(int i = 0; i < NCPU; i++)
+    printf(" %d", kcpu[i].npage);
+  printf(", zeroed %d)\n", zpool.npage);
+  printf("free blocks by order:");
+  for(o = 0; o <= KMAXORDER; o++)
+    printf(" %d", nfree[o]);
+  printf("\nlargest free block: order %d\n", top);
+}
+
+// Free memory in bytes, counting the per-CPU magazines
+// and the zeroed pool.
 uint64
 freemem_amount(void)
 {
-  return kmem.npage << PGSHIFT;
+  uint64 n = kmem.npage + zpool.npage;
+
+  for(int i = 0; i < NCPU; i++)
+    n += kcpu[i].npage;
+  return n << PGSHIFT;
 }
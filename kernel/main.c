@@ -16,6 +16,8 @@
 #include "include/vm.h"
 #include "include/disk.h"
 #include "include/buf.h"
+#include "include/pipe.h"
+#include "include/pcache.h"
 #ifndef QEMU
 #include "include/sdcard.h"
 #include "include/fpioa.h"
@@ -55,7 +57,11 @@ main(unsigned long hartid, unsigned long dtb_pa)
     disk_init();
     binit();         // buffer cache
     fileinit();      // file table
+    pcacheinit();    // file page cache
+    pipeinit();      // pipe cache
     userinit();      // first user process
+    if(kthread_create(bflusher, "bflush") < 0)
+      panic("bflusher");
     printf("hart 0 init done\n");
     
     for(int i = 1; i < NCPU; i++) {
@@ -0,0 +1,188 @@
+// Page cache for regular files.
+//
+// eread() and ewrite() go through whole 4096-byte pages cached by
+// (dirent, page index), so a read that hits takes no buffer at all.
+// Writes go through to the buffer cache, so a cached page is never
+// dirtier than the disk blocks below it, except while it is mapped
+// MAP_SHARED and written by a user.
+//
+// The data pages come from kalloc() and are mapped directly by mmap()
+// and exec(), which take their own kdup() references; then processes
+// using the same file share physical memory.  A page is only reclaimed
+// when it is neither held by pget() nor mapped, by preclaim() when
+// kalloc() runs dry, or to stay above PCACHE_RESERVE free pages.
+//
+// The caller of pget() must hold the dirent's lock, which is what
+// keeps two processes from setting up the same page at once.  Lock
+// order: ecache.lock, then pcache.lock.
+
+#include "include/types.h"
+#include "include/param.h"
+#include "include/riscv.h"
+#include "include/spinlock.h"
+#include "include/sleeplock.h"
+#include "include/fat32.h"
+#include "include/pcache.h"
+#include "include/kalloc.h"
+#include "include/slab.h"
+#include "include/printf.h"
+
+#define NPHASH  61
+
+struct {
+  struct spinlock lock;
+  struct kmem_cache *cache;
+  struct page *hash[NPHASH];
+  struct page lru;          // head of the LRU list
+  int npage;
+} pcache;
+
+static inline uint
+phash(struct dirent *ep, uint pgoff)
+{
+  return ((uint64)ep / sizeof(struct dirent) + pgoff) % NPHASH;
+}
+
+void
+pcacheinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+  if((pcache.cache = kmem_cache_create("page", sizeof(struct page))) == NULL)
+    panic("pcacheinit");
+  pcache.lru.prev = pcache.lru.next = &pcache.lru;
+}
+
+static void
+lru_remove(struct page *pg)
+{
+  pg->next->prev = pg->prev;
+  pg->prev->next = pg->next;
+}
+
+static void
+lru_push(struct page *pg)
+{
+  pg->next = pcache.lru.next;
+  pg->prev = &pcache.lru;
+  pcache.lru.next->prev = pg;
+  pcache.lru.next = pg;
+}
+
+// Take pg out of the cache and drop the cache's
+// reference to its data.  Caller holds pcache.lock.
+static void
+pfree(struct page *pg)
+{
+  struct page **pp;
+
+  for(pp = &pcache.hash[phash(pg->ep, pg->pgoff)]; *pp != pg; pp = &(*pp)->hnext)
+    ;
+  *pp = pg->hnext;
+  lru_remove(pg);
+  pg->ep->npage--;
+  pcache.npage--;
+  kfree(pg->data);
+  kmem_cache_free(pcache.cache, pg);
+}
+
+// Return the locked page pgoff of ep, which
+// is not valid if it was just set up, or 0 if out
+// of memory.  Caller must hold ep->lock.
+struct page*
+pget(struct dirent *ep, uint pgoff)
+{
+  struct page *pg;
+  char *mem;
+
+  acquire(&pcache.lock);
+  for(pg = pcache.hash[phash(ep, pgoff)]; pg; pg = pg->hnext){
+    if(pg->ep == ep && pg->pgoff == pgoff){
+      pg->ref++;
+      lru_remove(pg);
+      lru_push(pg);
+      release(&pcache.lock);
+      acquiresleep(&pg->lock);
+      return pg;
+    }
+  }
+  release(&pcache.lock);
+
+  if(freemem_amount() < PCACHE_RESERVE * PGSIZE)
+    preclaim();
+  if((mem = kalloc()) == NULL)
+    return NULL;
+  if((pg = kmem_cache_alloc(pcache.cache)) == NULL){
+    kfree(mem);
+    return NULL;
+  }
+  pg->ep = ep;
+  pg->pgoff = pgoff;
+  pg->ref = 1;
+  pg->valid = 0;
+  pg->data = mem;
+  initsleeplock(&pg->lock, "page");
+
+  acquire(&pcache.lock);
+  pg->hnext = pcache.hash[phash(ep, pgoff)];
+  pcache.hash[phash(ep, pgoff)] = pg;
+  lru_push(pg);
+  ep->npage++;
+  pcache.npage++;
+  release(&pcache.lock);
+  acquiresleep(&pg->lock);
+  return pg;
+}
+
+// Release a page from pget().
+void
+prelse(struct page *pg)
+{
+  if(!holdingsleep(&pg->lock))
+    panic("prelse");
+  releasesleep(&pg->lock);
+  acquire(&pcache.lock);
+  pg->ref--;
+  release(&pcache.lock);
+}
+
+// Drop every cached page of ep, because its clusters
+// were freed or the dirent is being reused.  Pages still
+// mapped stay with their mappings, cut off from the file.
+// Nobody may hold a page of ep.
+void
+pinval(struct dirent *ep)
+{
+  struct page *pg, *prev;
+
+  if(ep->npage == 0)
+    return;
+  acquire(&pcache.lock);
+  for(pg = pcache.lru.prev; pg != &pcache.lru && ep->npage > 0; pg = prev){
+    prev = pg->prev;
+    if(pg->ep != ep)
+      continue;
+    if(pg->ref != 0)
+      panic("pinval: busy");
+    pfree(pg);
+  }
+  release(&pcache.lock);
+}
+
+// Free the least recently used page that nobody holds
+// or maps.  Returns 1 if a page was freed.
+int
+preclaim(void)
+{
+  struct page *pg;
+
+  acquire(&pcache.lock);
+  for(pg = pcache.lru.prev; pg != &pcache.lru; pg = pg->prev){
+    if(pg->ref == 0 && !kshared(pg->data)){
+      pfree(pg);
+      release(&pcache.lock);
+      return 1;
+    }
+  }
+  release(&pcache.lock);
+  return 0;
+}
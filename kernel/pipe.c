@@ -9,6 +9,15 @@
 #include "include/pipe.h"
 #include "include/kalloc.h"
 #include "include/vm.h"
+#include "include/slab.h"
+
+static struct kmem_cache *pipe_cache;
+
+void
+pipeinit(void)
+{
+  pipe_cache = kmem_cache_create("pipe", sizeof(struct pipe));
+}
 
 int
 pipealloc(struct file **f0, struct file **f1)
@@ -19,7 +28,7 @@ pipealloc(struct file **f0, struct file **f1)
   *f0 = *f1 = 0;
   if((*f0 = filealloc()) == NULL || (*f1 = filealloc()) == NULL)
     goto bad;
-  if((pi = (struct pipe*)kalloc()) == NULL)
+  if((pi = kmem_cache_alloc(pipe_cache)) == NULL)
     goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
@@ -38,7 +47,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi)
-    kfree((char*)pi);
+    kmem_cache_free(pipe_cache, pi);
   if(*f0)
     fileclose(*f0);
   if(*f1)
@@ -59,7 +68,7 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
-    kfree((char*)pi);
+    kmem_cache_free(pipe_cache, pi);
   } else
     release(&pi->lock);
 }
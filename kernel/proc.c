@@ -13,6 +13,8 @@
 #include "include/file.h"
 #include "include/trap.h"
 #include "include/vm.h"
+#include "include/sbi.h"
+#include "include/timer.h"
 
 
 struct cpu cpus[NCPU];
@@ -24,10 +26,64 @@ struct proc *initproc;
 int nextpid = 1;
 struct spinlock pid_lock;
 
+// Per-CPU queues of RUNNABLE processes.  A process is put
+// on the queue of the hart it last ran on; idle harts steal
+// from busy ones.  SCHED_FIFO processes always run first,
+// highest priority first, and SCHED_NORMAL ones share
+// the rest fairly: the one that has had the least virtual
+// run time, its run time weighted by nice, goes next.
+// Virtual run time is measured against the queue's own
+// minvruntime, so it is rescaled when a process moves.
+// p->lock, if held, must be acquired before a queue's lock.
+struct runq {
+  struct spinlock lock;
+  struct proc *rt;             // SCHED_FIFO, linked through p->rqnext
+  struct proc *cfs[NPROC];     // SCHED_NORMAL, a min-heap on p->vruntime
+  int ncfs;
+  uint64 minvruntime;          // of the last one taken off cfs; never goes back
+  int n;                       // read without the lock by steal()
+  int idle;                    // hart asleep in idle(), waiting for an IPI
+  int fifo;                    // hart is running a SCHED_FIFO process
+} runq[NCPU];
+
+// How far behind the others a SCHED_NORMAL process that
+// has been asleep may start, in virtual time.
+#define SLEEPCREDIT (INTERVAL / 2)
+
+// Weight of each nice value, -20 to 19, as in Linux:
+// each step is about 10% of the CPU against the next.
+static const int niceweight[40] = {
+  88761, 71755, 56483, 46273, 36291,
+  29154, 23254, 18705, 14949, 11916,
+  9548,  7620,  6100,  4904,  3906,
+  3121,  2501,  1991,  1586,  1277,
+  1024,  820,   655,   526,   423,
+  335,   272,   215,   172,   137,
+  110,   87,    70,    56,    45,
+  36,    29,    23,    18,    15,
+};
+#define NICE0WEIGHT 1024
+
+// Sleeping processes, hashed by channel so that wakeup()
+// only looks at those that may be sleeping on its channel.
+// A process is linked on p->wq by sleep() and unlinked by
+// wakeup(), or by itself if woken some other way, by
+// kill() or wakeup1().
+// A queue's lock must be acquired before p->lock, except
+// by sleep(), when p is on no queue.
+#define NWAITQ 61
+#define WAITHASH(chan) (((uint64)(chan) >> 3) % NWAITQ)
+
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;
+} waitq[NWAITQ];
+
 extern void forkret(void);
 extern void swtch(struct context*, struct context*);
 static void wakeup1(struct proc *chan);
 static void freeproc(struct proc *p);
+static void ready(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
 
@@ -52,22 +108,24 @@ void
 procinit(void)
 {
   struct proc *p;
+  extern pagetable_t kernel_pagetable;
   
   initlock(&pid_lock, "nextpid");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
+  for(int i = 0; i < NWAITQ; i++)
+    initlock(&waitq[i].lock, "waitq");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
 
-      // Allocate a page for the process's kernel stack.
-      // Map it high in memory, followed by an invalid
-      // guard page.
-      // char *pa = kalloc();
-      // // printf("[procinit]kernel stack: %p\n", (uint64)pa);
-      // if(pa == 0)
-      //   panic("kalloc");
-      // uint64 va = KSTACK((int) (p - proc));
-      // // printf("[procinit]kvmmap va %p to pa %p\n", va, (uint64)pa);
-      // kvmmap(va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
-      // p->kstack = va;
+      // The process's kernel stack is mapped high in
+      // memory, followed by an invalid guard page.
+      // Make the page-table pages now, before any process
+      // page table shares them; allocproc() maps the stack.
+      p->kstack = KSTACK((int) (p - proc));
+      if(walk(kernel_pagetable, p->kstack, 1) == NULL)
+        panic("procinit");
+      p->asid = uvmasid(p - proc);
   }
   //kvminithart();
 
@@ -140,6 +198,12 @@ allocproc(void)
 
 found:
   p->pid = allocpid();
+  p->cpu = r_tp();
+  p->policy = SCHED_NORMAL;
+  p->nice = 0;
+  p->rtprio = 0;
+  // level with the queue fork() will put it on.
+  p->vruntime = runq[p->cpu].minvruntime;
   // 添加times修改 ADD THESE LINES to initialize the time fields
   p->utime = 0;
   p->stime = 0;
@@ -151,16 +215,16 @@ found:
     return NULL;
   }
 
-  // An empty user page table.
-  // And an identical kernel page table for this proc.
+  // A page table with the kernel but no user memory.
   if ((p->pagetable = proc_pagetable(p)) == NULL ||
-      (p->kpagetable = proc_kpagetable()) == NULL) {
+      kvmstack(p->kstack) < 0) {
     freeproc(p);
     release(&p->lock);
     return NULL;
   }
-
-  p->kstack = VKSTACK;
+  // the last process with this ASID may have left
+  // entries in any hart's TLB.
+  p->tlbstale = ~0UL;
 
   // Set up new context to start executing at forkret,
   // which returns to user space.
@@ -180,10 +244,6 @@ freeproc(struct proc *p)
   if(p->trapframe)
     kfree((void*)p->trapframe);
   p->trapframe = 0;
-  if (p->kpagetable) {
-    kvmfree(p->kpagetable, 1);
-  }
-  p->kpagetable = 0;
   if(p->pagetable)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
@@ -194,11 +254,13 @@ freeproc(struct proc *p)
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->kfn = 0;
   p->state = UNUSED;
 }
 
-// Create a user page table for a given process,
-// with no user memory, but with trampoline pages.
+// Create a page table for a given process,
+// with no user memory, but with the kernel
+// and trampoline pages.
 pagetable_t
 proc_pagetable(struct proc *p)
 {
@@ -296,7 +358,7 @@ userinit(void)
   
   // allocate one user page and copy init's instructions
   // and data into it.
-  uvminit(p->pagetable , p->kpagetable, initcode, sizeof(initcode));
+  uvminit(p->pagetable, initcode, sizeof(initcode));
   p->sz = PGSIZE;
 
   // prepare for the very first "return" from kernel to user.
@@ -305,7 +367,7 @@ userinit(void)
 
   safestrcpy(p->name, "initcode", sizeof(p->name));
 
-  p->state = RUNNABLE;
+  ready(p);
 
   p->tmask = 0;
 
@@ -315,6 +377,33 @@ userinit(void)
   #endif
 }
 
+static void
+kthread_start(void)
+{
+  // Still holding p->lock from scheduler.
+  release(&myproc()->lock);
+  myproc()->kfn();
+  panic("kthread returned");
+}
+
+// Start a kernel thread running fn, which must never return.
+// It has no user memory and never goes back to user space.
+int
+kthread_create(void (*fn)(void), char *name)
+{
+  struct proc *p;
+
+  if((p = allocproc()) == NULL)
+    return -1;
+  p->kfn = fn;
+  p->context.ra = (uint64)kthread_start;
+  safestrcpy(p->name, name, sizeof(p->name));
+  ready(p);
+  p->tmask = 0;
+  release(&p->lock);
+  return p->pid;
+}
+
 // Grow or shrink user memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
@@ -325,11 +414,13 @@ growproc(int n)
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, p->kpagetable, sz, sz + n)) == 0) {
+    // pages are allocated by uvmfault() on first touch.
+    if((uint64)sz + n > MMAPBASE)
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
-    sz = uvmdealloc(p->pagetable, p->kpagetable, sz, sz + n);
+    sz = uvmdealloc(p->pagetable, sz, sz + n);
+    uvmflush(p);
   }
   p->sz = sz;
   return 0;
@@ -350,11 +441,15 @@ fork(void)
   }
 
   // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, np->kpagetable, p->sz) < 0){
+  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0 ||
+     vma_fork(p, np) < 0){
+    uvmflush(p);
     freeproc(np);
     release(&np->lock);
     return -1;
   }
+  // our own pages are now read-only.
+  uvmflush(p);
   np->sz = p->sz;
 
   np->parent = p;
@@ -362,6 +457,11 @@ fork(void)
   // copy tracing mask from parent.
   np->tmask = p->tmask;
 
+  // and scheduling class.
+  np->policy = p->policy;
+  np->nice = p->nice;
+  np->rtprio = p->rtprio;
+
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
 
@@ -378,7 +478,7 @@ fork(void)
 
   pid = np->pid;
 
-  np->state = RUNNABLE;
+  ready(np);
 
   release(&np->lock);
 
@@ -422,6 +522,9 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // Write back and drop mmap() regions while the files are open.
+  vma_exit(p);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -457,6 +560,7 @@ exit(int status)
   // the parent-then-child rule says we have to lock it first.
   acquire(&original_parent->lock);
   // 添加times修改 ADD THESE LINES to pass the child's times to its parent
+  p->stime += r_time() - p->tstamp;
   original_parent->cutime += p->utime;
   original_parent->cstime += p->stime;
   acquire(&p->lock);
@@ -491,6 +595,10 @@ wait(uint64 addr, int pid_to_wait)
   int havekids, pid;
   struct proc *p = myproc(); // 获取当前进程（父进程）的指针
 
+  // copyout2() below runs under locks, so it must not read a file.
+  if(addr != 0 && vma_prefault(p, addr, sizeof(int), 1) < 0)
+    return -1;
+
   // 在整个函数执行期间，我们都持有父进程的锁 p->lock。
   // 这是为了防止“丢失唤醒”问题：即在我们检查完所有子进程但还未调用 sleep() 之前，
   // 一个子进程恰好退出并尝试唤醒我们，如果我们不持有锁，这个唤醒就会丢失。
@@ -564,13 +672,20 @@ clone(uint64 stack)
   }
 
   // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, np->kpagetable, p->sz) < 0){
+  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0 ||
+     vma_fork(p, np) < 0){
+    uvmflush(p);
     freeproc(np);
     release(&np->lock);
     return -1;
   }
+  // our own pages are now read-only.
+  uvmflush(p);
   np->sz = p->sz;
   np->parent = p;
+  np->policy = p->policy;
+  np->nice = p->nice;
+  np->rtprio = p->rtprio;
   
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -595,16 +710,259 @@ clone(uint64 stack)
 
   pid = np->pid;
 
-  np->state = RUNNABLE;
+  ready(np);
 
   release(&np->lock);
 
   return pid;
 }
+// Send an IPI for a newly queued process: to wake hart id,
+// on whose queue it is, or to have it preempt an ordinary
+// process for a real-time one, or else to wake any other
+// idle hart to steal it.
+// Interrupts must be disabled.
+static void
+kick(int id, int rt)
+{
+  static unsigned long hartmask[NCPU];  // for sbi_send_ipi(), not on the stack
+  int self = cpuid();
+
+  // pairs with the one in idle().
+  __sync_synchronize();
+  if(runq[id].idle || (rt && !runq[id].fifo))
+    goto send;
+  for(id = 0; id < NCPU; id++)
+    if(id != self && runq[id].idle)
+      goto send;
+  return;
+
+ send:
+  hartmask[id] = 1UL << id;
+  sbi_send_ipi(&hartmask[id]);
+}
+
+// Sleep until an interrupt: a device, a sleeper's
+// deadline, or another hart's IPI when there is work.
+// The timer is not kept ticking meanwhile.
+static void
+idle(int id)
+{
+  int i;
+
+  // with interrupts off, an IPI after the check below
+  // stays pending, and wfi returns at once.
+  intr_off();
+  runq[id].idle = 1;
+  __sync_synchronize();
+  for(i = 0; i < NCPU; i++)
+    if(runq[i].n > 0)
+      break;
+  if(i == NCPU){
+    timer_idle();
+    asm volatile("wfi");
+  }
+  runq[id].idle = 0;
+  intr_on();
+}
+
+// Charge the running process p for the time since it was
+// dispatched, in virtual time: the lower its nice value,
+// the slower that goes.
+static void
+charge(struct proc *p)
+{
+  uint64 now = r_time();
+
+  if(p->policy == SCHED_NORMAL)
+    p->vruntime += (now - p->runstart) * NICE0WEIGHT / niceweight[p->nice + 20];
+  p->runstart = now;
+}
+
+// p is moving from hart from's run queue to hart to's:
+// keep its lead or lag on the queue's minimum the same.
+static void
+rescale(struct proc *p, int from, int to)
+{
+  uint64 min = runq[to].minvruntime;
+  long lag = p->vruntime - runq[from].minvruntime;
+
+  if(lag < 0 && (uint64)-lag > min)
+    p->vruntime = 0;
+  else
+    p->vruntime = min + lag;
+}
+
+static void
+cfsswap(struct runq *rq, int i, int j)
+{
+  struct proc *p = rq->cfs[i];
+
+  rq->cfs[i] = rq->cfs[j];
+  rq->cfs[j] = p;
+}
+
+// Restore the heap order around cfs[i].
+static void
+cfsfix(struct runq *rq, int i)
+{
+  int c;
+
+  while(i > 0 && rq->cfs[(i - 1) / 2]->vruntime > rq->cfs[i]->vruntime){
+    cfsswap(rq, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+  for(;;){
+    c = 2 * i + 1;
+    if(c >= rq->ncfs)
+      break;
+    if(c + 1 < rq->ncfs && rq->cfs[c + 1]->vruntime < rq->cfs[c]->vruntime)
+      c++;
+    if(rq->cfs[i]->vruntime <= rq->cfs[c]->vruntime)
+      break;
+    cfsswap(rq, i, c);
+    i = c;
+  }
+}
+
+static void
+cfsdel(struct runq *rq, int i)
+{
+  rq->ncfs--;
+  if(i == rq->ncfs)
+    return;
+  rq->cfs[i] = rq->cfs[rq->ncfs];
+  cfsfix(rq, i);
+}
+
+// Make p RUNNABLE and put it on the run queue of the
+// hart it last ran on, or, if it is a real-time process
+// waking up and that hart is busy with another, on one
+// that isn't.
+// Caller must hold p->lock.
+static void
+ready(struct proc *p)
+{
+  struct runq *rq;
+  struct proc **pp;
+  int i;
+
+  if(!holding(&p->lock))
+    panic("ready");
+  if(p->state == RUNNING)
+    charge(p);
+  else if(p->policy == SCHED_FIFO && runq[p->cpu].fifo){
+    for(i = 0; i < NCPU; i++){
+      if(!runq[i].fifo){
+        rescale(p, p->cpu, i);
+        p->cpu = i;
+        break;
+      }
+    }
+  }
+  p->state = RUNNABLE;
+  rq = &runq[p->cpu];
+  acquire(&rq->lock);
+  if(p->policy == SCHED_FIFO){
+    // behind those of the same or higher priority.
+    for(pp = &rq->rt; *pp && (*pp)->rtprio >= p->rtprio; pp = &(*pp)->rqnext)
+      ;
+    p->rqnext = *pp;
+    *pp = p;
+  } else {
+    // a sleeper doesn't get to catch up on all the
+    // time it spent asleep, only on about a slice.
+    if(p->vruntime + SLEEPCREDIT < rq->minvruntime)
+      p->vruntime = rq->minvruntime - SLEEPCREDIT;
+    rq->cfs[rq->ncfs] = p;
+    cfsfix(rq, rq->ncfs++);
+  }
+  p->onrq = 1;
+  rq->n++;
+  release(&rq->lock);
+  kick(p->cpu, p->policy == SCHED_FIFO);
+}
+
+// Take the RUNNABLE p off its run queue, to be put back
+// by ready() after a change of scheduling class.
+// Returns 0 if it is not on one, because a scheduler
+// has just taken it off to run it.
+// Caller must hold p->lock.
+static int
+unready(struct proc *p)
+{
+  struct runq *rq = &runq[p->cpu];
+  struct proc **pp;
+  int i;
+
+  acquire(&rq->lock);
+  if(!p->onrq){
+    release(&rq->lock);
+    return 0;
+  }
+  for(pp = &rq->rt; *pp; pp = &(*pp)->rqnext){
+    if(*pp == p){
+      *pp = p->rqnext;
+      break;
+    }
+  }
+  for(i = 0; i < rq->ncfs; i++){
+    if(rq->cfs[i] == p){
+      cfsdel(rq, i);
+      break;
+    }
+  }
+  p->onrq = 0;
+  rq->n--;
+  release(&rq->lock);
+  return 1;
+}
+
+// Take the next process to run off hart id's run queue,
+// or return 0 if it is empty.
+static struct proc*
+runqget(int id)
+{
+  struct runq *rq = &runq[id];
+  struct proc *p = 0;
+
+  acquire(&rq->lock);
+  if(rq->rt){
+    p = rq->rt;
+    rq->rt = p->rqnext;
+  } else if(rq->ncfs > 0){
+    p = rq->cfs[0];
+    cfsdel(rq, 0);
+    if(p->vruntime > rq->minvruntime)
+      rq->minvruntime = p->vruntime;
+  }
+  if(p){
+    p->onrq = 0;
+    rq->n--;
+  }
+  release(&rq->lock);
+  return p;
+}
+
+// Steal a process from the busiest other hart.
+static struct proc*
+steal(int id)
+{
+  int i, victim = -1, most = 0;
+
+  for(i = 0; i < NCPU; i++){
+    if(i != id && runq[i].n > most){
+      most = runq[i].n;
+      victim = i;
+    }
+  }
+  return victim < 0 ? NULL : runqget(victim);
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - choose a process to run, from this hart's
+//    run queue or, if that is empty, another's.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
@@ -613,40 +971,51 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
   extern pagetable_t kernel_pagetable;
 
   c->proc = 0;
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
-    // printf("s:%d ", intr_get());  // 加上探针debug
-    int found = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        // printf("[scheduler]found runnable proc with pid: %d\n", p->pid);
-        p->state = RUNNING;
-        c->proc = p;
-        w_satp(MAKE_SATP(p->kpagetable));
-        sfence_vma();
-        swtch(&c->context, &p->context);
-        w_satp(MAKE_SATP(kernel_pagetable));
-        sfence_vma();
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-
-        found = 1;
-      }
-      release(&p->lock);
-    }
-    if(found == 0) {
-      intr_on();
-      asm volatile("wfi");
+    if((p = runqget(id)) == NULL && (p = steal(id)) == NULL){
+      // Use idle time to zero pages, and only sleep when there's nothing to do.
+      if(kzero_idle() == 0)
+        idle(id);
+      continue;
     }
+
+    // A full time slice.  Not under p->lock, which
+    // timer_tick() may want while holding timers.lock.
+    set_next_timeout();
+
+    // If p has just been queued by yield() on another
+    // hart, this waits until that hart is off its stack.
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler");
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    if(p->cpu != id)
+      rescale(p, p->cpu, id);   // stolen
+    p->cpu = id;
+    p->runstart = p->tstamp = r_time();
+    runq[id].fifo = p->policy == SCHED_FIFO;
+    c->proc = p;
+    uvmswitch(p);
+    swtch(&c->context, &p->context);
+    // off p's page table, which may be freed once
+    // p->lock is released.  the kernel's mappings
+    // are the same, and user ones are flushed by the
+    // next uvmswitch() if need be.
+    w_satp(MAKE_SATP(kernel_pagetable));
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    runq[id].fifo = 0;
+    release(&p->lock);
   }
 }
 
@@ -672,18 +1041,42 @@ sched(void)
   if(intr_get())
     panic("sched interruptible");
 
+  // yield() has charged p already, in ready(), before
+  // queueing it by its vruntime.
+  if(p->state != RUNNABLE)
+    charge(p);
+  p->stime += r_time() - p->tstamp;
   intena = mycpu()->intena;
   swtch(&p->context, &mycpu()->context);
   mycpu()->intena = intena;
 }
 
+// The time slice is over, or another hart has sent an IPI
+// for a real-time process: give up the CPU, unless this is
+// a real-time process and none of higher priority waits.
+void
+preempt(void)
+{
+  struct proc *p = myproc();
+  struct proc *rt;
+
+  if(p->policy == SCHED_FIFO){
+    push_off();
+    rt = runq[cpuid()].rt;
+    pop_off();
+    if(rt == NULL || rt->rtprio <= p->rtprio)
+      return;
+  }
+  yield();
+}
+
 // Give up the CPU for one scheduling round.
 void
 yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  ready(p);
   sched();
   release(&p->lock);
 }
@@ -718,32 +1111,48 @@ void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct waitq *wq = &waitq[WAITHASH(chan)];
+  struct proc **pp;
   
-  // Must acquire p->lock in order to
-  // change p->state and then call sched.
-  // Once we hold p->lock, we can be
-  // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
-  // so it's okay to release lk.
-  if(lk != &p->lock){  //DOC: sleeplock0
+  // Must join chan's wait queue, and acquire p->lock in
+  // order to change p->state and then call sched.
+  // Once on the queue, we can be guaranteed that we
+  // won't miss any wakeup (wakeup locks the queue,
+  // then p->lock), so it's okay to release lk.
+  acquire(&wq->lock);
+  if(lk != &p->lock)  //DOC: sleeplock0
     acquire(&p->lock);  //DOC: sleeplock1
+  p->chan = chan;
+  p->wq = wq;
+  p->wqnext = wq->head;
+  wq->head = p;
+  release(&wq->lock);
+  if(lk != &p->lock)
     release(lk);
-  }
 
   // Go to sleep.
-  p->chan = chan;
   p->state = SLEEPING;
 
   sched();
 
-  // Tidy up.
+  // Tidy up.  If kill() or wakeup1() woke us,
+  // we are still on the queue.
+  release(&p->lock);
+  if(p->wq){
+    acquire(&wq->lock);
+    for(pp = &wq->head; *pp; pp = &(*pp)->wqnext){
+      if(*pp == p){
+        *pp = p->wqnext;
+        break;
+      }
+    }
+    p->wq = 0;
+    release(&wq->lock);
+  }
   p->chan = 0;
 
   // Reacquire original lock.
-  if(lk != &p->lock){
-    release(&p->lock);
-    acquire(lk);
-  }
+  acquire(lk);
 }
 
 // Wake up all processes sleeping on chan.
@@ -751,15 +1160,23 @@ sleep(void *chan, struct spinlock *lk)
 void
 wakeup(void *chan)
 {
-  struct proc *p;
+  struct waitq *wq = &waitq[WAITHASH(chan)];
+  struct proc **pp, *p;
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == SLEEPING && p->chan == chan) {
-      p->state = RUNNABLE;
+  acquire(&wq->lock);
+  for(pp = &wq->head; (p = *pp) != NULL; ){
+    if(p->chan != chan){
+      pp = &p->wqnext;
+      continue;
     }
+    *pp = p->wqnext;
+    p->wq = 0;
+    acquire(&p->lock);
+    if(p->state == SLEEPING)
+      ready(p);
     release(&p->lock);
   }
+  release(&wq->lock);
 }
 
 // Wake up p if it is sleeping in wait(); used by exit().
@@ -770,7 +1187,7 @@ wakeup1(struct proc *p)
   if(!holding(&p->lock))
     panic("wakeup1");
   if(p->chan == p && p->state == SLEEPING) {
-    p->state = RUNNABLE;
+    ready(p);
   }
 }
 
@@ -788,7 +1205,7 @@ kill(int pid)
       p->killed = 1;
       if(p->state == SLEEPING){
         // Wake process from sleep().
-        p->state = RUNNABLE;
+        ready(p);
       }
       release(&p->lock);
       return 0;
@@ -798,6 +1215,79 @@ kill(int pid)
   return -1;
 }
 
+static struct proc*
+findproc(int pid)
+{
+  struct proc *p;
+
+  if(pid == 0)
+    pid = myproc()->pid;
+  for(p = proc; p < &proc[NPROC]; p++){
+    acquire(&p->lock);
+    if(p->pid == pid && p->state != UNUSED)
+      return p;
+    release(&p->lock);
+  }
+  return NULL;
+}
+
+// Set the nice value of process pid, or of the
+// caller if pid is 0, clamped to -20..19.
+int
+setnice(int pid, int nice)
+{
+  struct proc *p;
+
+  if((p = findproc(pid)) == NULL)
+    return -1;
+  if(nice < -20)
+    nice = -20;
+  if(nice > 19)
+    nice = 19;
+  p->nice = nice;
+  release(&p->lock);
+  return 0;
+}
+
+// Nice value of process pid, or of the caller if pid is 0.
+// Returns 0 and sets *nice, or -1 if there is no such process.
+int
+getnice(int pid, int *nice)
+{
+  struct proc *p;
+
+  if((p = findproc(pid)) == NULL)
+    return -1;
+  *nice = p->nice;
+  release(&p->lock);
+  return 0;
+}
+
+// Make process pid, or the caller if pid is 0,
+// SCHED_FIFO with priority prio, 1 to 99,
+// or SCHED_NORMAL, with prio 0.
+int
+setscheduler(int pid, int policy, int prio)
+{
+  struct proc *p;
+  int queued;
+
+  if(policy == SCHED_FIFO ? prio < 1 || prio > 99 :
+     policy != SCHED_NORMAL || prio != 0)
+    return -1;
+  if((p = findproc(pid)) == NULL)
+    return -1;
+  queued = p->state == RUNNABLE && unready(p);
+  if(p->policy != policy && policy == SCHED_NORMAL)
+    p->vruntime = runq[p->cpu].minvruntime;
+  p->policy = policy;
+  p->rtprio = prio;
+  if(queued)
+    ready(p);
+  release(&p->lock);
+  return 0;
+}
+
 // Copy to either a user address, or kernel address,
 // depending on usr_dst.
 // Returns 0 on success, -1 on error.
@@ -857,6 +1347,7 @@ procdump(void)
     printf("%d\t%s\t%s\t%d", p->pid, state, p->name, p->sz);
     printf("\n");
   }
+  kmemdump();
 }
 
 uint64
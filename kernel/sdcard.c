@@ -87,6 +87,9 @@ static void sd_end_cmd(void) {
 #define SD_CMD16 	16 		// SET_BLOCK_SIZE 
 #define SD_CMD17 	17 		// READ_SINGLE_BLOCK
 #define SD_CMD24 	24 		// WRITE_SINGLE_BLOCK 
+#define SD_CMD12 	12 		// STOP_TRANSMISSION
+#define SD_CMD18 	18 		// READ_MULTIPLE_BLOCK
+#define SD_CMD25 	25 		// WRITE_MULTIPLE_BLOCK
 #define SD_CMD13 	13 		// SEND_STATUS
 
 /*
@@ -444,6 +447,149 @@ void sdcard_write_sector(uint8 *buf, int sectorno) {
 	// leave critical section!
 }
 
+/*
+ * Wait until the card releases the busy signal (DO held low).
+ */
+static int sd_wait_ready(void) {
+	uint8 result;
+	int timeout = 0xffffff;
+	while (--timeout) {
+		sd_read_data(&result, 1);
+		if (0 != result) break;
+	}
+	return timeout ? 0 : -1;
+}
+
+void sdcard_read_sectors(uint8 **bufs, int sectorno, int count) {
+	uint8 result;
+	uint32 address;
+	uint8 dummy_crc[2];
+
+	if (count == 1) {
+		sdcard_read_sector(bufs[0], sectorno);
+		return;
+	}
+
+	if (is_standard_sd) {
+		address = sectorno << 9;
+	}
+	else {
+		address = sectorno;
+	}
+
+	// enter critical section!
+	acquiresleep(&sdcard_lock);
+
+	sd_send_cmd(SD_CMD18, address, 0);
+	result = sd_get_response_R1();
+
+	if (0 != result) {
+		releasesleep(&sdcard_lock);
+		panic("sdcard: fail to read");
+	}
+
+	for (int i = 0; i < count; i ++) {
+		int timeout = 0xffffff;
+		while (--timeout) {
+			sd_read_data(&result, 1);
+			if (0xfe == result) break;
+		}
+		if (0 == timeout) {
+			panic("sdcard: timeout waiting for reading");
+		}
+		sd_read_data_dma(bufs[i], BSIZE);
+		sd_read_data(dummy_crc, 2);
+	}
+
+	// stop the transfer, skipping the stuff byte before R1b
+	sd_send_cmd(SD_CMD12, 0, 0);
+	sd_read_data(&result, 1);
+	result = sd_get_response_R1();
+	if (0 != result || 0 != sd_wait_ready()) {
+		releasesleep(&sdcard_lock);
+		panic("sdcard: fail to stop reading");
+	}
+	sd_end_cmd();
+
+	releasesleep(&sdcard_lock);
+	// leave critical section!
+}
+
+void sdcard_write_sectors(uint8 **bufs, int sectorno, int count) {
+	uint32 address;
+	static uint8 const START_MULTI_TOKEN = 0xfc;
+	static uint8 const STOP_TRAN_TOKEN = 0xfd;
+	uint8 dummy_crc[2] = {0xff, 0xff};
+
+	if (count == 1) {
+		sdcard_write_sector(bufs[0], sectorno);
+		return;
+	}
+
+	if (is_standard_sd) {
+		address = sectorno << 9;
+	}
+	else {
+		address = sectorno;
+	}
+
+	// enter critical section!
+	acquiresleep(&sdcard_lock);
+
+	sd_send_cmd(SD_CMD25, address, 0);
+	if (0 != sd_get_response_R1()) {
+		releasesleep(&sdcard_lock);
+		panic("sdcard: fail to write");
+	}
+
+	uint8 result;
+	for (int i = 0; i < count; i ++) {
+		sd_write_data(&START_MULTI_TOKEN, 1);
+		sd_write_data_dma(bufs[i], BSIZE);
+		sd_write_data(dummy_crc, 2);
+
+		int timeout = 0xfff;
+		while (--timeout) {
+			sd_read_data(&result, 1);
+			if (0x05 == (result & 0x1f)) {
+				break;
+			}
+		}
+		if (0 == timeout) {
+			releasesleep(&sdcard_lock);
+			panic("sdcard: invalid response token");
+		}
+		if (0 != sd_wait_ready()) {
+			releasesleep(&sdcard_lock);
+			panic("sdcard: timeout waiting for response");
+		}
+	}
+
+	sd_write_data(&STOP_TRAN_TOKEN, 1);
+	sd_read_data(&result, 1);		// one byte before busy shows up
+	if (0 != sd_wait_ready()) {
+		releasesleep(&sdcard_lock);
+		panic("sdcard: timeout waiting for response");
+	}
+	sd_end_cmd();
+
+	// send SD_CMD13 to check if writing is correctly done 
+	uint8 error_code = 0xff;
+	sd_send_cmd(SD_CMD13, 0, 0);
+	result = sd_get_response_R1();
+	sd_read_data(&error_code, 1);
+	sd_end_cmd();
+	if (0 != result || 0 != error_code) {
+		releasesleep(&sdcard_lock);
+		printf("result: %x\n", result);
+		printf("error_code: %x\n", error_code);
+		panic("sdcard: an error occurs when writing");
+	}
+
+	releasesleep(&sdcard_lock);
+	// leave critical section!
+}
+
 // A simple test for sdcard read/write test 
 void test_sdcard(void) {
 	uint8 buf[BSIZE];
@@ -0,0 +1,197 @@
+// Object caches for small kernel structures.
+//
+// Each cache hands out objects of one size, packed into whole pages
+// from kalloc().  A page starts with a struct slab header, followed
+// by the objects; free objects are linked through their first word,
+// and the header is found again by rounding an object's address down.
+//
+// Every CPU keeps a stash of up to KSTASH free objects per cache, so
+// most allocations and frees take no lock; the stash refills from and
+// drains to the slabs KSTASH/2 objects at a time.  A cache keeps at
+// most one slab with no object in use and returns the others to kalloc().
+
+#include "include/types.h"
+#include "include/param.h"
+#include "include/riscv.h"
+#include "include/spinlock.h"
+#include "include/slab.h"
+#include "include/kalloc.h"
+#include "include/intr.h"
+#include "include/proc.h"
+#include "include/string.h"
+#include "include/printf.h"
+
+struct slab {
+  struct slab *next;          // on the cache's partial list
+  struct slab *prev;
+  void *free;                 // free objects
+  int inuse;
+  int onlist;
+};
+
+#define SLAB_HDR    ((sizeof(struct slab) + 15) & ~15)
+
+static struct kmem_cache caches[NKCACHE];
+static int ncache;
+
+// Create a cache of objects of the given size.
+// Only called while booting, on one hart.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size)
+{
+  struct kmem_cache *c;
+
+  size = (size + 15) & ~15;
+  if(ncache == NKCACHE || size > PGSIZE - SLAB_HDR)
+    panic("kmem_cache_create");
+  c = &caches[ncache++];
+  safestrcpy(c->name, name, sizeof(c->name));
+  c->size = size;
+  c->perslab = (PGSIZE - SLAB_HDR) / size;
+  initlock(&c->lock, c->name);
+  c->partial = 0;
+  c->nslab = 0;
+  c->nempty = 0;
+  for(int i = 0; i < NCPU; i++)
+    c->stash[i].n = 0;
+  return c;
+}
+
+// Caller holds c->lock.
+static void
+partial_insert(struct kmem_cache *c, struct slab *s)
+{
+  s->prev = 0;
+  s->next = c->partial;
+  if(c->partial)
+    c->partial->prev = s;
+  c->partial = s;
+  s->onlist = 1;
+}
+
+// Caller holds c->lock.
+static void
+partial_remove(struct kmem_cache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+  s->onlist = 0;
+}
+
+// Carve a new page into free objects.
+static struct slab*
+slab_new(struct kmem_cache *c)
+{
+  struct slab *s;
+  char *obj;
+
+  if((s = kalloc()) == NULL)
+    return NULL;
+  s->free = 0;
+  s->inuse = 0;
+  obj = (char*)s + SLAB_HDR + (c->perslab - 1) * c->size;
+  for(int i = 0; i < c->perslab; i++, obj -= c->size){
+    *(void**)obj = s->free;
+    s->free = obj;
+  }
+  return s;
+}
+
+// Take an object from the slabs.  Caller holds c->lock.
+static void*
+slab_get(struct kmem_cache *c)
+{
+  struct slab *s = c->partial;
+  void *obj;
+
+  if(s == 0)
+    return 0;
+  obj = s->free;
+  s->free = *(void**)obj;
+  if(s->inuse++ == 0)
+    c->nempty--;
+  if(s->free == 0)
+    partial_remove(c, s);
+  return obj;
+}
+
+// Give an object back to its slab.  Caller holds c->lock.
+// Returns a page to free once the lock is dropped, or 0.
+static void*
+slab_put(struct kmem_cache *c, void *obj)
+{
+  struct slab *s = (struct slab*)PGROUNDDOWN((uint64)obj);
+
+  *(void**)obj = s->free;
+  s->free = obj;
+  if(!s->onlist)
+    partial_insert(c, s);
+  if(--s->inuse == 0){
+    if(c->nempty > 0){
+      partial_remove(c, s);
+      c->nslab--;
+      return s;
+    }
+    c->nempty++;
+  }
+  return 0;
+}
+
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct slab *s;
+  void *obj;
+  int id;
+
+  push_off();
+  id = cpuid();
+  if(c->stash[id].n == 0){
+    acquire(&c->lock);
+    while(c->stash[id].n < KSTASH / 2){
+      if((obj = slab_get(c)) == 0){
+        release(&c->lock);
+        s = slab_new(c);
+        acquire(&c->lock);
+        if(s == 0)
+          break;
+        c->nslab++;
+        c->nempty++;
+        partial_insert(c, s);
+        continue;
+      }
+      c->stash[id].obj[c->stash[id].n++] = obj;
+    }
+    release(&c->lock);
+  }
+  obj = c->stash[id].n > 0 ? c->stash[id].obj[--c->stash[id].n] : 0;
+  pop_off();
+  return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *c, void *obj)
+{
+  void *page[KSTASH / 2];
+  int id, n = 0;
+
+  push_off();
+  id = cpuid();
+  if(c->stash[id].n == KSTASH){
+    acquire(&c->lock);
+    while(c->stash[id].n > KSTASH / 2){
+      void *pa = slab_put(c, c->stash[id].obj[--c->stash[id].n]);
+      if(pa)
+        page[n++] = pa;
+    }
+    release(&c->lock);
+  }
+  c->stash[id].obj[c->stash[id].n++] = obj;
+  pop_off();
+  while(n > 0)
+    kfree(page[--n]);
+}
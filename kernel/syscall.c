@@ -15,6 +15,7 @@
 #include "include/sbi.h"
 #include "include/file.h"
 #include "include/fcntl.h"
+#include "include/timer.h"
 
 // Fetch the uint64 at addr from the current process.
 int
@@ -133,11 +134,16 @@ extern uint64 sys_yield(void);
 extern uint64 sys_getppid(void);
 extern uint64 sys_gettimeofday(void);
 extern uint64 sys_nanosleep(void);
+extern uint64 sys_setpriority(void);
+extern uint64 sys_getpriority(void);
+extern uint64 sys_sched_setscheduler(void);
 extern uint64 sys_dup3(void);
 extern uint64 sys_getdents64(void);
 extern uint64 sys_unlinkat(void);
 extern uint64 sys_mount(void);
 extern uint64 sys_umount2(void);
+extern uint64 sys_sync(void);
+extern uint64 sys_fsync(void);
 
 static uint64 (*syscalls[])(void) = {
   [SYS_fork]        sys_fork,
@@ -180,11 +186,16 @@ static uint64 (*syscalls[])(void) = {
   [SYS_getppid]     sys_getppid,
   [SYS_gettimeofday]sys_gettimeofday,
   [SYS_nanosleep]   sys_nanosleep,
+  [SYS_setpriority] sys_setpriority,
+  [SYS_getpriority] sys_getpriority,
+  [SYS_sched_setscheduler] sys_sched_setscheduler,
   [SYS_dup2]        sys_dup3,
   [SYS_getdents]    sys_getdents64,
   [SYS_unlink]      sys_unlinkat,
   [SYS_mount]       sys_mount,
   [SYS_umount]      sys_umount2,
+  [SYS_sync]        sys_sync,
+  [SYS_fsync]       sys_fsync,
 };
 
 static char *sysnames[] = {
@@ -228,11 +239,16 @@ static char *sysnames[] = {
   [SYS_getppid]     "getppid",
   [SYS_gettimeofday]"gettimeofday",
   [SYS_nanosleep]   "nanosleep",
+  [SYS_setpriority] "setpriority",
+  [SYS_getpriority] "getpriority",
+  [SYS_sched_setscheduler] "sched_setscheduler",
   [SYS_dup2]        "dup2",
   [SYS_getdents]    "getdents",
   [SYS_unlink]      "unlink",
   [SYS_mount]       "mount",
   [SYS_umount]      "umount",
+  [SYS_sync]        "sync",
+  [SYS_fsync]       "fsync",
 };
 
 void
@@ -286,6 +302,7 @@ sys_sysinfo(void)
 }
 
 uint64 sys_shutdown(void) {
+  fat32_sync();
   sbi_shutdown();
   return 0;
 }
@@ -297,9 +314,6 @@ struct tms {
   uint64 tms_cutime; /* user time of children */
   uint64 tms_cstime; /* system time of children */
 };
-// You may need to declare these if they are not in included headers
-extern struct spinlock tickslock;
-extern uint64 ticks;
 
 uint64
 sys_times(void)
@@ -313,16 +327,12 @@ sys_times(void)
     return -1;
   }
 
-  // 2. 填充 tms 结构体
-  // 我们需要获取 tickslock 来安全地读取全局 ticks
-  // 进程特定的时间通常在 trap 中更新，也最好在锁内读取以保证一致性
-  acquire(&tickslock);
-  tms_buf.tms_utime = p->utime;
-  tms_buf.tms_stime = p->stime;
-  tms_buf.tms_cutime = p->cutime;
-  tms_buf.tms_cstime = p->cstime;
-  uint64 current_ticks = ticks;  // 顺便读取一下系统总的开机时间
-  release(&tickslock);   // 读完解锁
+  // 2. 填充 tms 结构体, times are kept in r_time() units
+  tms_buf.tms_utime = p->utime / INTERVAL;
+  tms_buf.tms_stime = (p->stime + r_time() - p->tstamp) / INTERVAL;
+  tms_buf.tms_cutime = p->cutime / INTERVAL;
+  tms_buf.tms_cstime = p->cstime / INTERVAL;
+  uint64 current_ticks = timer_ticks();  // 顺便读取一下系统总的开机时间
 
   // 3. 将内核中填充好的结构体拷贝回用户空间地址
   if (copyout2(addr, (char *)&tms_buf, sizeof(tms_buf)) < 0) {
@@ -403,8 +413,7 @@ sys_mmap(void)
   uint64 addr, len, offset;
   int prot, flags, fd;
   struct proc *p = myproc();
-  struct file *f;
-  uint64 va;
+  struct file *f = 0;
 
   // 1. 从用户空间获取 mmap 的所有参数
   // addr: 建议的映射起始地址, len: 映射长度, prot: 内存保护标志
@@ -415,38 +424,14 @@ sys_mmap(void)
     return (uint64)-1; 
   }
 
-  // 2. 根据文件描述符 fd 找到对应的文件结构体
-  // 测试用例中，fd 是由 open 调用返回的一个有效文件描述符
-  if (fd < 0 || fd >= NOFILE || (f = p->ofile[fd]) == 0) {
-    return (uint64)-1;
-  }
-  
-  // 3. 分配虚拟内存
-  // 为了简化实现，我们忽略用户建议的 addr 地址，直接在进程现有内存的末尾（p->sz）进行分配。
-  // 测试用例传的 addr 是 NULL，表示由内核选择地址，所以这个策略是符合测试要求的。
-  va = p->sz;
-  if (growproc(len) < 0) {
-    // 如果内存分配失败（比如超过了物理内存限制）
-    return (uint64)-1;
-  }
-  // growproc 函数成功后，p->sz 会增加 len，新分配的虚拟地址范围就是 [va, p->sz)
-  
-  // 4. 从文件中读取内容到新分配的内存中
-  // 首先，需要把文件的内部偏移量设置为 mmap 参数中指定的 offset
-  // 注意：在多线程环境下直接修改 f->off 不是安全的，但在我们的简单内核和当前测试场景下是可行的。
-  f->off = offset;
-  
-  // 调用 file.c 中实现的 fileread 函数。
-  // 这个函数会负责把文件内容读到内核缓冲区，再通过 copyout2 拷贝到用户指定的虚拟地址 va
-  if (fileread(f, va, len) != len) {
-    // 如果实际读到的字节数和请求的长度不符，说明读取出错了。
-    // 这时需要回滚刚才的内存分配操作，防止内存泄漏。
-    growproc(-len);
+  // 2. 根据文件描述符 fd 找到对应的文件结构体（匿名映射不需要）
+  if (!(flags & MAP_ANONYMOUS) &&
+      (fd < 0 || fd >= NOFILE || (f = p->ofile[fd]) == 0)) {
     return (uint64)-1;
   }
 
-  // 5.返回映射区域的起始地址
-  return va;
+  // 3. 只建立映射区域，页面在第一次访问时由 vma_fault() 从文件读入
+  return vma_map(p, addr, len, prot, flags, f, offset);
 }
 
 uint64
@@ -459,17 +444,8 @@ sys_munmap(void)
     return -1;
   }
 
-  // 2. (核心) 调用 growproc 缩减内存
-  // growproc 会负责释放页面和取消页表映射
-  // 注意：这里我们没有做严格的地址检查，
-  // 是因为我们确信测试用例会传递由 mmap 刚刚分配在顶部的地址。
-  // 一个更健壮的实现需要检查 addr 是否为合法映射区域的起始点。
-  if (growproc(-len) < 0) {
-    return -1;
-  }
-
-  // 3. 成功，根据 munmap 的规范，返回 0
-  return 0;
+  // 2. 解除 [addr, addr+len) 中的所有映射，MAP_SHARED 的页面写回文件
+  return vma_unmap(myproc(), addr, len);
 }
 
 struct timeval{
@@ -477,9 +453,6 @@ struct timeval{
   uint64 tv_usec;
 };
 
-extern uint64 ticks;
-extern struct spinlock tickslock;
-
 uint64
 sys_gettimeofday(void)
 {
@@ -177,6 +177,33 @@ sys_close(void)
   return 0;
 }
 
+uint64
+sys_sync(void)
+{
+  fat32_sync();
+  return 0;
+}
+
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  if(f->type != FD_ENTRY)
+    return -1;
+  elock(f->ep);
+  if(f->ep->parent){
+    elock(f->ep->parent);
+    eupdate(f->ep);
+    eunlock(f->ep->parent);
+  }
+  eunlock(f->ep);
+  fat32_sync();
+  return 0;
+}
+
 uint64
 sys_fstat(void)
 {
@@ -974,6 +1001,7 @@ sys_umount2(void)
   if(argstr(0, special, FAT32_MAX_PATH) < 0){
       return -1;
   }
+  fat32_sync();
   // 简单返回 0 表示成功
   return 0;
 }
\ No newline at end of file
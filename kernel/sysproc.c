@@ -117,21 +117,12 @@ uint64
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
 
   if(argint(0, &n) < 0)
     return -1;
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(myproc()->killed){
-      release(&tickslock);
-      return -1;
-    }
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
-  return 0;
+  if(n <= 0)
+    return 0;
+  return timer_sleep(r_time() + (uint64)n * INTERVAL);
 }
 
 uint64
@@ -149,12 +140,7 @@ sys_kill(void)
 uint64
 sys_uptime(void)
 {
-  uint xticks;
-
-  acquire(&tickslock);
-  xticks = ticks;
-  release(&tickslock);
-  return xticks;
+  return timer_ticks();
 }
 
 uint64
@@ -215,8 +201,6 @@ uint64
 sys_nanosleep(void) {
   uint64 user_ts_addr;
   struct timespec ts;
-  uint ticks0;
-  uint goal_ticks;
   // 从用户空间获取指向timespec的指针
   if(argaddr(0, &user_ts_addr)<0) {
     return -1;
@@ -225,26 +209,63 @@ sys_nanosleep(void) {
   if(copyin2((char *)&ts, user_ts_addr, sizeof(ts)) <0) {
     return -1;
   }
-  // 将请求的休眠时间转换成内核的 ticks数量
-  // 基于100Hz 的tick rate 计算（1tick = 10ms = 10,000,000ns)
-  goal_ticks = ts.tv_sec * 100 + ts.tv_nsec / 10000000;
-  // 如果请求的休眠时间小于1个tick 直接返回
-  if(goal_ticks ==0) {
-    return 0;
-  }
-  // 使用sys_sleep相同的休眠机制
-  acquire(&tickslock);  
-  ticks0 = ticks;
-  while(ticks - ticks0 < goal_ticks) {
-    if(myproc()->killed) {
-      release(&tickslock);
-      return -1;
-    }
-    // 使用sleep()函数，让出CPU，等待时钟中断唤醒
-    // sleep() 会原子地释放 tickslock
-    sleep(&ticks, &tickslock);
+  if(ts.tv_nsec >= 1000000000)
+    return -1;
+  // the timer wakes us at the deadline itself, not at
+  // the next tick, so sleeps shorter than one still count.
+  // one too long to count in r_time() is forever.
+  uint64 now = r_time();
+  uint64 left = ~0UL - now;
+  uint64 when = ~0UL;
+  if(ts.tv_sec < left / TIMEBASE){
+    uint64 d = ts.tv_sec * TIMEBASE + (ts.tv_nsec * TIMEBASE + 999999999) / 1000000000;
+    if(d < left)
+      when = now + d;
   }
-  release(&tickslock);
+  return timer_sleep(when);
+}
+// setpriority(which, who, prio): set the nice value of
+// process who, or of the caller if who is 0.
+uint64
+sys_setpriority(void)
+{
+  int which, who, prio;
 
-  return 0;
-}
\ No newline at end of file
+  if(argint(0, &which) < 0 || argint(1, &who) < 0 || argint(2, &prio) < 0)
+    return -1;
+  if(which != PRIO_PROCESS)
+    return -1;
+  return setnice(who, prio);
+}
+
+// getpriority(which, who): as Linux's system call, returns
+// 20 - nice, from 1 to 40, so that it is never negative.
+uint64
+sys_getpriority(void)
+{
+  int which, who, nice;
+
+  if(argint(0, &which) < 0 || argint(1, &who) < 0)
+    return -1;
+  if(which != PRIO_PROCESS || getnice(who, &nice) < 0)
+    return -1;
+  return 20 - nice;
+}
+
+struct sched_param {
+  int sched_priority;
+};
+
+uint64
+sys_sched_setscheduler(void)
+{
+  int pid, policy;
+  uint64 addr;
+  struct sched_param param;
+
+  if(argint(0, &pid) < 0 || argint(1, &policy) < 0 || argaddr(2, &addr) < 0)
+    return -1;
+  if(copyin2((char *)&param, addr, sizeof(param)) < 0)
+    return -1;
+  return setscheduler(pid, policy, param.sched_priority);
+}
@@ -10,16 +10,101 @@
 #include "include/printf.h"
 #include "include/proc.h"
 
-struct spinlock tickslock;
-uint ticks;
+// Processes sleeping until a time, in a min-heap ordered
+// by deadline, so that a timer interrupt only wakes those
+// whose time has come.  A process is in it at most once.
+struct {
+  struct spinlock lock;
+  int n;
+  struct {
+    uint64 when;
+    struct proc *p;
+  } t[NPROC];
+} timers;
+
+static uint64 nexttick[NCPU];   // when each hart's time slice ends, ~0 if idle
+static uint64 nextfire[NCPU];   // what each hart's timer is set for
 
 void timerinit() {
-    initlock(&tickslock, "time");
+    initlock(&timers.lock, "timers");
     #ifdef DEBUG
     printf("timerinit\n");
     #endif
 }
 
+static void
+timerswap(int i, int j)
+{
+  uint64 when = timers.t[i].when;
+  struct proc *p = timers.t[i].p;
+
+  timers.t[i] = timers.t[j];
+  timers.t[j].when = when;
+  timers.t[j].p = p;
+}
+
+// Restore the heap order around entry i.
+static void
+timerfix(int i)
+{
+  int c;
+
+  while(i > 0 && timers.t[(i - 1) / 2].when > timers.t[i].when){
+    timerswap(i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+  for(;;){
+    c = 2 * i + 1;
+    if(c >= timers.n)
+      break;
+    if(c + 1 < timers.n && timers.t[c + 1].when < timers.t[c].when)
+      c++;
+    if(timers.t[i].when <= timers.t[c].when)
+      break;
+    timerswap(i, c);
+    i = c;
+  }
+}
+
+static void
+timerdel(int i)
+{
+  timers.n--;
+  if(i == timers.n)
+    return;
+  timers.t[i] = timers.t[timers.n];
+  timerfix(i);
+}
+
+// Take p out of the heap, if the timer hasn't already.
+static void
+timercancel(struct proc *p)
+{
+  for(int i = 0; i < timers.n; i++){
+    if(timers.t[i].p == p){
+      timerdel(i);
+      return;
+    }
+  }
+}
+
+// Set this hart's timer for the end of the time slice,
+// or for the earliest deadline if that comes sooner.
+// With neither, it is set for never.
+// Caller must hold timers.lock.
+static void
+timerprogram(int id)
+{
+  uint64 when = nexttick[id];
+
+  if(timers.n > 0 && timers.t[0].when < when)
+    when = timers.t[0].when;
+  nextfire[id] = when;
+  sbi_set_timer(when);
+}
+
+// Start a time slice of INTERVAL on this hart, for
+// the process about to run.
 void
 set_next_timeout() {
     // There is a very strange bug,
@@ -28,13 +113,83 @@ set_next_timeout() {
 
     // this bug seems to disappear automatically
     // printf("");
-    sbi_set_timer(r_time() + INTERVAL);
+    int id = cpuid();
+
+    acquire(&timers.lock);
+    nexttick[id] = r_time() + INTERVAL;
+    timerprogram(id);
+    release(&timers.lock);
+}
+
+// This hart is going idle: no more ticks, only
+// sleepers' deadlines, until set_next_timeout().
+void
+timer_idle(void)
+{
+  int id = cpuid();
+
+  acquire(&timers.lock);
+  nexttick[id] = ~0UL;
+  timerprogram(id);
+  release(&timers.lock);
 }
 
-void timer_tick() {
-    acquire(&tickslock);
-    ticks++;
-    wakeup(&ticks);
-    release(&tickslock);
-    set_next_timeout();
+// Ticks since boot.  Worked out from the time, as
+// idle harts take no tick interrupts to count.
+uint
+timer_ticks(void)
+{
+  return r_time() / INTERVAL;
+}
+
+// Handle a timer interrupt: wake the sleepers whose time
+// has come, and see if this hart's time slice is over.
+// Returns 1 if it was, 0 if only a deadline passed.
+int timer_tick() {
+    int id = cpuid();
+    uint64 now = r_time();
+    int tick = 0;
+
+    if(now >= nexttick[id]){
+      nexttick[id] = now + INTERVAL;
+      tick = 1;
+    }
+    acquire(&timers.lock);
+    while(timers.n > 0 && timers.t[0].when <= now){
+      wakeup(timers.t[0].p);
+      timerdel(0);
+    }
+    timerprogram(id);
+    release(&timers.lock);
+    return tick;
+}
+
+// Sleep until r_time() reaches when.
+// Returns 0, or -1 if killed first.
+int
+timer_sleep(uint64 when)
+{
+  struct proc *p = myproc();
+  int i, id, r = 0;
+
+  acquire(&timers.lock);
+  i = timers.n++;
+  timers.t[i].when = when;
+  timers.t[i].p = p;
+  timerfix(i);
+  // nothing else will interrupt this hart in time.
+  id = cpuid();
+  if(when < nextfire[id])
+    timerprogram(id);
+  while(r_time() < when){
+    if(p->killed){
+      r = -1;
+      break;
+    }
+    sleep(p, &timers.lock);
+  }
+  // killed, or woken by some other wakeup(p).
+  timercancel(p);
+  release(&timers.lock);
+  return r;
 }
@@ -12,6 +12,7 @@
 #include "include/console.h"
 #include "include/timer.h"
 #include "include/disk.h"
+#include "include/vm.h"
 
 extern char trampoline[], uservec[], userret[];
 
@@ -61,6 +62,11 @@ usertrap(void)
   w_stvec((uint64)kernelvec);
 
   struct proc *p = myproc();
+  uint64 now = r_time();
+
+  // the time since usertrapret() was spent in user space.
+  p->utime += now - p->tstamp;
+  p->tstamp = now;
   
   // save user program counter.
   p->trapframe->epc = r_sepc();
@@ -77,6 +83,10 @@ usertrap(void)
     intr_on();
     syscall();
   } 
+  else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+          uvmfault(p, r_stval(), r_scause() == 15) == 0){
+    // lazily allocated, mmap()ed or copy-on-write page
+  }
   else if((which_dev = devintr()) != 0){
     // ok
   } 
@@ -90,12 +100,10 @@ usertrap(void)
   if(p->killed)
     exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2) {
-    // 添加times修改 Add this line to increment user time ticks
-    myproc()->utime++;
-    yield();
-  }
+  // give up the CPU if this is a timer interrupt,
+  // or an IPI for a real-time process.
+  if(which_dev >= 2)
+    preempt();
   usertrapret();
 }
 
@@ -106,18 +114,24 @@ void
 usertrapret(void)
 {
   struct proc *p = myproc();
+  uint64 now;
 
   // we're about to switch the destination of traps from
   // kerneltrap() to usertrap(), so turn off interrupts until
   // we're back in user space, where usertrap() is correct.
   intr_off();
 
+  // the time since usertrap(), or since the scheduler
+  // switched to p, was spent in the kernel.
+  now = r_time();
+  p->stime += now - p->tstamp;
+  p->tstamp = now;
+
   // send syscalls, interrupts, and exceptions to trampoline.S
   w_stvec(TRAMPOLINE + (uservec - trampoline));
 
   // set up trapframe values that uservec will need when
   // the process next re-enters the kernel.
-  p->trapframe->kernel_satp = r_satp();         // kernel page table
   p->trapframe->kernel_sp = p->kstack + PGSIZE; // process's kernel stack
   p->trapframe->kernel_trap = (uint64)usertrap;
   p->trapframe->kernel_hartid = r_tp();         // hartid for cpuid()
@@ -134,15 +148,11 @@ usertrapret(void)
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
 
-  // tell trampoline.S the user page table to switch to.
-  // printf("[usertrapret]p->pagetable: %p\n", p->pagetable);
-  uint64 satp = MAKE_SATP(p->pagetable);
-
-  // jump to trampoline.S at the top of memory, which 
-  // switches to the user page table, restores user registers,
-  // and switches to user mode with sret.
+  // jump to trampoline.S at the top of memory, which
+  // restores user registers and switches to user mode
+  // with sret.  the page table stays the same.
   uint64 fn = TRAMPOLINE + (userret - trampoline);
-  ((void (*)(uint64,uint64))fn)(TRAPFRAME, satp);
+  ((void (*)(uint64))fn)(TRAPFRAME);
 }
 
 // interrupts and exceptions from kernel code go here via kernelvec,
@@ -170,12 +180,10 @@ kerneltrap() {
   }
   // printf("which_dev: %d\n", which_dev);
   
-  // give up the CPU if this is a timer interrupt.
-  if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING) {
-    //添加times修改  Add this line to increment system time ticks
-    myproc()->stime++;
-    yield();
-  }
+  // give up the CPU if this is a timer interrupt,
+  // or an IPI for a real-time process.
+  if(which_dev >= 2 && myproc() != 0 && myproc()->state == RUNNING)
+    preempt();
   // the yield() may have caused some traps to occur,
   // so restore trap registers for use by kernelvec.S's sepc instruction.
   w_sepc(sepc);
@@ -184,7 +192,8 @@ kerneltrap() {
 
 // Check if it's an external/software interrupt, 
 // and handle it. 
-// returns  2 if timer interrupt, 
+// returns  3 if an IPI to reschedule, 
+//          2 if timer interrupt, 
 //          1 if other device, 
 //          0 if not recognized. 
 int devintr(void) {
@@ -224,9 +233,16 @@ int devintr(void) {
 
 		return 1;
 	}
+	else if (0x8000000000000001L == scause) {
+		// an IPI from kick(): an idle hart has work,
+		// or a real-time process is waiting for this one.
+		w_sip(r_sip() & ~2);
+		return 3;
+	}
 	else if (0x8000000000000005L == scause) {
-		timer_tick();
-		return 2;
+		// only a tick, not an early sleeper's
+		// deadline, ends the time slice.
+		return timer_tick() ? 2 : 1;
 	}
 	else { return 0;}
 }
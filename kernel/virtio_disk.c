@@ -41,8 +41,17 @@ static struct disk {
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
+  // the request header lives here too, so that the
+  // submitter needn't wait on its own stack.
   struct {
-    struct buf *b;
+    struct virtio_blk_outhdr {
+      uint32 type;
+      uint32 reserved;
+      uint64 sector;
+    } hdr;
+    struct buf *bufs[DISK_VEC_MAX];
+    int n;
+    void (*done)(struct buf **, int);
     char status;
   } info[NUM];
   
@@ -159,9 +168,9 @@ free_chain(int i)
 }
 
 static int
-alloc3_desc(int *idx)
+allocn_desc(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -175,64 +184,91 @@ alloc3_desc(int *idx)
 void
 virtio_disk_rw(struct buf *b, int write)
 {
-  uint64 sector = b->sectorno;
+  virtio_disk_rw_vec(&b, 1, write);
+}
+
+// read or write n buffers holding consecutive sectors,
+// starting at bufs[0]->sectorno, as one request,
+// and wait for it to finish.
+void
+virtio_disk_rw_vec(struct buf **bufs, int n, int write)
+{
+  virtio_disk_submit(bufs, n, write, 0);
+  virtio_disk_wait(bufs[0]);
+}
+
+// queue a request for n buffers holding consecutive sectors
+// and return without waiting for the device.
+// on completion, virtio_disk_intr() calls done(bufs, n) if
+// it is not 0; either way bufs[0]->disk drops to 0 and
+// virtio_disk_wait(bufs[0]) returns.
+// the buffers must stay locked until then.
+void
+virtio_disk_submit(struct buf **bufs, int n, int write, void (*done)(struct buf **, int))
+{
+  uint64 sector = bufs[0]->sectorno;
+
+  if(n < 1 || n > DISK_VEC_MAX)
+    panic("virtio_disk_submit");
 
   acquire(&disk.vdisk_lock);
 
-  // the spec says that legacy block operations use three
-  // descriptors: one for type/reserved/sector, one for
-  // the data, one for a 1-byte status result.
+  // the spec says that legacy block operations use a chain of
+  // descriptors: one for type/reserved/sector, one for each piece
+  // of data, one for a 1-byte status result.
 
-  // allocate the three descriptors.
-  int idx[3];
+  // allocate n + 2 descriptors.
+  int idx[DISK_VEC_MAX + 2];
   while(1){
-    if(alloc3_desc(idx) == 0) {
+    if(allocn_desc(idx, n + 2) == 0) {
       break;
     }
     sleep(&disk.free[0], &disk.vdisk_lock);
   }
   
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_outhdr {
-    uint32 type;
-    uint32 reserved;
-    uint64 sector;
-  } buf0;
+  struct virtio_blk_outhdr *buf0 = &disk.info[idx[0]].hdr;
 
   if(write)
-    buf0.type = VIRTIO_BLK_T_OUT; // write the disk
+    buf0->type = VIRTIO_BLK_T_OUT; // write the disk
   else
-    buf0.type = VIRTIO_BLK_T_IN; // read the disk
-  buf0.reserved = 0;
-  buf0.sector = sector;
-
-  // buf0 is on a kernel stack, which is not direct mapped,
-  // thus the call to kvmpa().
-  disk.desc[idx[0]].addr = (uint64) kwalkaddr(myproc()->kpagetable, (uint64) &buf0);
-  disk.desc[idx[0]].len = sizeof(buf0);
+    buf0->type = VIRTIO_BLK_T_IN; // read the disk
+  buf0->reserved = 0;
+  buf0->sector = sector;
+
+  disk.desc[idx[0]].addr = (uint64) buf0;
+  disk.desc[idx[0]].len = sizeof(*buf0);
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(int i = 0; i < n; i++){
+    struct VRingDesc *d = &disk.desc[idx[i + 1]];
+    if(bufs[i]->sectorno != sector + i)
+      panic("virtio_disk_submit: not consecutive");
+    d->addr = (uint64) bufs[i]->data;
+    d->len = BSIZE;
+    if(write)
+      d->flags = 0; // device reads b->data
+    else
+      d->flags = VRING_DESC_F_WRITE; // device writes b->data
+    d->flags |= VRING_DESC_F_NEXT;
+    d->next = idx[i + 2];
+    disk.info[idx[0]].bufs[i] = bufs[i];
+  }
 
   disk.info[idx[0]].status = 0;
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+  disk.desc[idx[n + 1]].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[idx[n + 1]].len = 1;
+  disk.desc[idx[n + 1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[idx[n + 1]].next = 0;
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  // record the request for virtio_disk_intr().
+  // the first buffer stands for the whole request.
+  bufs[0]->disk = 1;
+  disk.info[idx[0]].n = n;
+  disk.info[idx[0]].done = done;
 
   // avail[0] is flags
   // avail[1] tells the device how far to look in avail[2...].
@@ -244,14 +280,17 @@ virtio_disk_rw(struct buf *b, int write)
 
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
 
-  // Wait for virtio_disk_intr() to say request has finished.
+  release(&disk.vdisk_lock);
+}
+
+// wait for the request that b heads to finish.
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
-
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
-
   release(&disk.vdisk_lock);
 }
 
@@ -266,8 +305,14 @@ virtio_disk_intr()
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
     
-    disk.info[id].b->disk = 0;   // disk is done with buf
-    wakeup(disk.info[id].b);
+    disk.info[id].bufs[0]->disk = 0;   // disk is done with buf
+    wakeup(disk.info[id].bufs[0]);
+    // done() runs before the chain is freed, so that
+    // info[id] can't be reused under it.
+    if(disk.info[id].done)
+      disk.info[id].done(disk.info[id].bufs, disk.info[id].n);
+    disk.info[id].done = 0;
+    free_chain(id);
 
     disk.used_idx = (disk.used_idx + 1) % NUM;
   }
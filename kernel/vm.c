@@ -6,6 +6,7 @@
 #include "include/vm.h"
 #include "include/kalloc.h"
 #include "include/proc.h"
+#include "include/intr.h"
 #include "include/printf.h"
 #include "include/string.h"
 
@@ -14,6 +15,10 @@
  */
 pagetable_t kernel_pagetable;
 
+// bits of ASID the harts implement; 0 if too few
+// to give every process an address space of its own.
+static int asidbits;
+
 extern char etext[];  // kernel.ld sets this to end of kernel code.
 extern char trampoline[]; // trampoline.S
 /*
@@ -91,6 +96,22 @@ kvminit()
 void
 kvminithart()
 {
+  #ifdef QEMU
+  // find out how many ASID bits there are: the
+  // unimplemented ones read back as zero.
+  // the K210 (privileged spec 1.9.1) has none in satp,
+  // and its PUM bit, left clear, already lets the
+  // kernel at user pages.
+  w_satp(MAKE_SATP(kernel_pagetable) | SATP_ASID(0xffff));
+  uint64 asid = r_satp() >> 44 & 0xffff;
+  for(asidbits = 0; asid & (1L << asidbits); asidbits++)
+    ;
+  if((1 << asidbits) <= NPROC)
+    asidbits = 0;
+  // the kernel runs on the process page tables, and
+  // copyin()/copyout() reach user memory directly.
+  w_sstatus(r_sstatus() | SSTATUS_SUM);
+  #endif
   w_satp(MAKE_SATP(kernel_pagetable));
   // reg_info();
   sfence_vma();
@@ -123,9 +144,8 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
     if(*pte & PTE_V) {
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == NULL)
+      if(!alloc || (pagetable = (pde_t*)kalloc_zeroed()) == NULL)
         return NULL;
-      memset(pagetable, 0, PGSIZE);
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
@@ -158,13 +178,37 @@ walkaddr(pagetable_t pagetable, uint64 va)
 // add a mapping to the kernel page table.
 // only used when booting.
 // does not flush TLB or enable paging.
+// the kernel is mapped in every page table,
+// so its mappings are global.
 void
 kvmmap(uint64 va, uint64 pa, uint64 sz, int perm)
 {
-  if(mappages(kernel_pagetable, va, sz, pa, perm) != 0)
+  if(mappages(kernel_pagetable, va, sz, pa, perm | PTE_G) != 0)
     panic("kvmmap");
 }
 
+// Map a kernel stack at va, if there isn't one yet.
+// procinit() has made the page-table pages, which every
+// page table shares, so the stack appears in all of them.
+// Stacks are kept for the next process in the slot,
+// since no hart's TLB can then hold a freed one.
+// Returns 0, or -1 if out of memory.
+int
+kvmstack(uint64 va)
+{
+  pte_t *pte;
+  char *pa;
+
+  if((pte = walk(kernel_pagetable, va, 0)) == NULL)
+    panic("kvmstack");
+  if(*pte & PTE_V)
+    return 0;
+  if((pa = kalloc()) == NULL)
+    return -1;
+  *pte = PA2PTE(pa) | PTE_R | PTE_W | PTE_G | PTE_V;
+  return 0;
+}
+
 // translate a kernel virtual address to
 // a physical address. only needed for
 // addresses on the stack.
@@ -245,16 +289,42 @@ vmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
   }
 }
 
-// create an empty user page table.
+// Like vmunmap(), but for user memory, where pages
+// of a lazily grown heap may never have been mapped.
+void
+uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
+{
+  uint64 a;
+  pte_t *pte;
+
+  if((va % PGSIZE) != 0)
+    panic("uvmunmap: not aligned");
+
+  for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
+    if((pte = walk(pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
+    if(PTE_FLAGS(*pte) == PTE_V)
+      panic("uvmunmap: not a leaf");
+    if(do_free)
+      kfree((void*)PTE2PA(*pte));
+    *pte = 0;
+  }
+}
+
+// create a page table with no user memory, but with the
+// kernel, whose level-1 page-table pages it shares with
+// kernel_pagetable.  the top level-2 entry is left to
+// the process, for its trampoline and trapframe.
 // returns 0 if out of memory.
 pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kalloc_zeroed();
   if(pagetable == NULL)
     return NULL;
-  memset(pagetable, 0, PGSIZE);
+  for(int i = PX(2, MAXUVA); i < PX(2, TRAMPOLINE); i++)
+    pagetable[i] = kernel_pagetable[i];
   return pagetable;
 }
 
@@ -262,17 +332,15 @@ uvmcreate()
 // for the very first process.
 // sz must be less than a page.
 void
-uvminit(pagetable_t pagetable, pagetable_t kpagetable, uchar *src, uint sz)
+uvminit(pagetable_t pagetable, uchar *src, uint sz)
 {
   char *mem;
 
   if(sz >= PGSIZE)
     panic("inituvm: more than a page");
-  mem = kalloc();
+  mem = kalloc_zeroed();
   // printf("[uvminit]kalloc: %p\n", mem);
-  memset(mem, 0, PGSIZE);
   mappages(pagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X|PTE_U);
-  mappages(kpagetable, 0, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_X);
   memmove(mem, src, sz);
   // for (int i = 0; i < sz; i ++) {
   //   printf("[uvminit]mem: %p, %x\n", mem + i, mem[i]);
@@ -282,7 +350,7 @@ uvminit(pagetable_t pagetable, pagetable_t kpagetable, uchar *src, uint sz)
 // Allocate PTEs and physical memory to grow process from oldsz to
 // newsz, which need not be page aligned.  Returns new size or 0 on error.
 uint64
-uvmalloc(pagetable_t pagetable, pagetable_t kpagetable, uint64 oldsz, uint64 newsz)
+uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 {
   char *mem;
   uint64 a;
@@ -292,21 +360,14 @@ uvmalloc(pagetable_t pagetable, pagetable_t kpagetable, uint64 oldsz, uint64 new
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kalloc_zeroed();
     if(mem == NULL){
-      uvmdealloc(pagetable, kpagetable, a, oldsz);
+      uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if (mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0) {
       kfree(mem);
-      uvmdealloc(pagetable, kpagetable, a, oldsz);
-      return 0;
-    }
-    if (mappages(kpagetable, a, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R) != 0){
-      int npages = (a - oldsz) / PGSIZE;
-      vmunmap(pagetable, oldsz, npages + 1, 1);   // plus the page allocated above.
-      vmunmap(kpagetable, oldsz, npages, 0);
+      uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
   }
@@ -318,15 +379,14 @@ uvmalloc(pagetable_t pagetable, pagetable_t kpagetable, uint64 oldsz, uint64 new
 // need to be less than oldsz.  oldsz can be larger than the actual
 // process size.  Returns the new process size.
 uint64
-uvmdealloc(pagetable_t pagetable, pagetable_t kpagetable, uint64 oldsz, uint64 newsz)
+uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 {
   if(newsz >= oldsz)
     return oldsz;
 
   if(PGROUNDUP(newsz) < PGROUNDUP(oldsz)){
     int npages = (PGROUNDUP(oldsz) - PGROUNDUP(newsz)) / PGSIZE;
-    vmunmap(kpagetable, PGROUNDUP(newsz), npages, 0);
-    vmunmap(pagetable, PGROUNDUP(newsz), npages, 1);
+    uvmunmap(pagetable, PGROUNDUP(newsz), npages, 1);
   }
 
   return newsz;
@@ -353,57 +413,185 @@ freewalk(pagetable_t pagetable)
 }
 
 // Free user memory pages,
-// then free page-table pages.
+// then free page-table pages,
+// all but the kernel's.
 void
 uvmfree(pagetable_t pagetable, uint64 sz)
 {
   if(sz > 0)
-    vmunmap(pagetable, 0, PGROUNDUP(sz)/PGSIZE, 1);
+    uvmunmap(pagetable, 0, PGROUNDUP(sz)/PGSIZE, 1);
+  for(int i = PX(2, MAXUVA); i < PX(2, TRAMPOLINE); i++)
+    pagetable[i] = 0;
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Given a parent process's page table, share
+// its memory with a child's page table.
+// The caller must flush the TLB.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
-uvmcopy(pagetable_t old, pagetable_t new, pagetable_t knew, uint64 sz)
+uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+{
+  return uvmshare(old, new, 0, sz, 1);
+}
+
+// Map the pages present in [start, end) of old into new
+// as well.  If cow, writable pages become read-only copy-on-write
+// pages in both, to be copied by uvmcow() on the first store;
+// otherwise they stay writable and shared, as for MAP_SHARED.
+// The caller must flush the TLB.
+// returns 0 on success, -1 on failure, leaving
+// nothing mapped in new.
+int
+uvmshare(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int cow)
 {
   pte_t *pte;
-  uint64 pa, i = 0, ki = 0;
+  uint64 pa, i = start;
   uint flags;
-  char *mem;
 
-  while (i < sz){
-    if((pte = walk(old, i, 0)) == NULL)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+  while (i < end){
+    if((pte = walk(old, i, 0)) == NULL || (*pte & PTE_V) == 0){
+      // never touched; the child will fault it in.
+      i += PGSIZE;
+      continue;
+    }
+    if(cow && (*pte & PTE_W))
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == NULL)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0) {
-      kfree(mem);
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    }
+    kdup((void*)pa);
     i += PGSIZE;
-    if(mappages(knew, ki, PGSIZE, (uint64)mem, flags & ~PTE_U) != 0){
-      goto err;
-    }
-    ki += PGSIZE;
   }
   return 0;
 
  err:
-  vmunmap(knew, 0, ki / PGSIZE, 0);
-  vmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
   return -1;
 }
 
+// Replace the page mapped at va with pa, which the caller
+// holds a reference to, and free the old one.  A writable
+// mapping becomes copy-on-write.  For exec() to map pages
+// of the page cache into a page table not yet in use.
+void
+uvmreplace(pagetable_t pagetable, uint64 va, uint64 pa)
+{
+  pte_t *pte;
+  uint flags;
+
+  if((pte = walk(pagetable, va, 0)) == NULL || (*pte & PTE_V) == 0)
+    panic("uvmreplace");
+  flags = PTE_FLAGS(*pte);
+  if(flags & PTE_W)
+    flags = (flags & ~PTE_W) | PTE_COW;
+  kfree((void*)PTE2PA(*pte));
+  *pte = PA2PTE(pa) | flags;
+}
+
+// Give p, the current process, its own copy of the
+// copy-on-write page at va, or just make the page
+// writable again if no one else shares it.
+// Returns 0 on success, -1 if va is not a COW page
+// or memory ran out.
+int
+uvmcow(struct proc *p, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+  if((pte = walk(p->pagetable, va, 0)) == NULL)
+    return -1;
+  if((*pte & (PTE_V | PTE_U | PTE_COW)) != (PTE_V | PTE_U | PTE_COW))
+    return -1;
+  pa = PTE2PA(*pte);
+  if(kshared((void*)pa)){
+    if((mem = kalloc()) == NULL)
+      return -1;
+    memmove(mem, (char*)pa, PGSIZE);
+    kfree((void*)pa);
+    pa = (uint64)mem;
+  }
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  *pte = PA2PTE(pa) | flags;
+  uvmflush(p);
+  return 0;
+}
+
+// Handle a page fault at va by p: hand it to vma_fault()
+// if va is in a region from mmap() or exec(), else map a
+// zeroed page where the heap was grown but never touched,
+// or copy a copy-on-write page on a store.
+// Returns 0 if the access can be retried.
+int
+uvmfault(struct proc *p, uint64 va, int write)
+{
+  pte_t *pte;
+  char *mem;
+
+  if(vma_find(p, va) != NULL)
+    return vma_fault(p, va, write);
+  if(va >= p->sz)
+    return -1;
+  va = PGROUNDDOWN(va);
+  pte = walk(p->pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    if(write && (*pte & PTE_COW))
+      return uvmcow(p, va);
+    return -1;
+  }
+  if((mem = kalloc_zeroed()) == NULL)
+    return -1;
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// End of the user region holding va: the program
+// and heap below p->sz, or an mmap() region.
+// Returns 0 if va is in neither.
+static uint64
+uvmend(uint64 va)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+
+  if(va < p->sz)
+    return p->sz;
+  if((v = vma_find(p, va)) != NULL)
+    return v->end;
+  return 0;
+}
+
+// The kernel cannot take a fault on user memory,
+// so fault in [va, va+len) before touching it:
+// missing heap and mmap() pages, and COW pages if write.
+int
+uvmtouch(uint64 va, uint64 len, int write)
+{
+  struct proc *p = myproc();
+  uint64 va0;
+  pte_t *pte;
+
+  for(va0 = PGROUNDDOWN(va); va0 < va + len; va0 += PGSIZE){
+    pte = walk(p->pagetable, va0, 0);
+    if(pte && (*pte & PTE_V) && (!write || (*pte & PTE_W)))
+      continue;
+    if(uvmfault(p, va0, write) < 0)
+      return -1;
+  }
+  return 0;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -445,10 +633,12 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 int
 copyout2(uint64 dstva, char *src, uint64 len)
 {
-  uint64 sz = myproc()->sz;
+  uint64 sz = uvmend(dstva);
   if (dstva + len > sz || dstva >= sz) {
     return -1;
   }
+  if (uvmtouch(dstva, len, 1) < 0)
+    return -1;
   memmove((void *)dstva, src, len);
   return 0;
 }
@@ -481,10 +671,12 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 int
 copyin2(char *dst, uint64 srcva, uint64 len)
 {
-  uint64 sz = myproc()->sz;
+  uint64 sz = uvmend(srcva);
   if (srcva + len > sz || srcva >= sz) {
     return -1;
   }
+  if (uvmtouch(srcva, len, 0) < 0)
+    return -1;
   memmove(dst, (void *)srcva, len);
   return 0;
 }
@@ -536,9 +728,15 @@ int
 copyinstr2(char *dst, uint64 srcva, uint64 max)
 {
   int got_null = 0;
-  uint64 sz = myproc()->sz;
+  uint64 sz = uvmend(srcva);
+  uint64 va0 = -1;
   while(srcva < sz && max > 0){
     char *p = (char *)srcva;
+    if(PGROUNDDOWN(srcva) != va0){
+      va0 = PGROUNDDOWN(srcva);
+      if(uvmtouch(va0, 1, 0) < 0)
+        return -1;
+    }
     if(*p == '\0'){
       *dst = '\0';
       got_null = 1;
@@ -557,70 +755,44 @@ copyinstr2(char *dst, uint64 srcva, uint64 max)
   }
 }
 
-// initialize kernel pagetable for each process.
-pagetable_t
-proc_kpagetable()
+// ASID for the process in proc[] slot i, or 0 if
+// there aren't enough and the TLB has to be flushed
+// on every switch instead.
+int
+uvmasid(int i)
 {
-  pagetable_t kpt = (pagetable_t) kalloc();
-  if (kpt == NULL)
-    return NULL;
-  memmove(kpt, kernel_pagetable, PGSIZE);
-
-  // remap stack and trampoline, because they share the same page table of level 1 and 0
-  char *pstack = kalloc();
-  if(pstack == NULL)
-    goto fail;
-  if (mappages(kpt, VKSTACK, PGSIZE, (uint64)pstack, PTE_R | PTE_W) != 0)
-    goto fail;
-  
-  return kpt;
-
-fail:
-  kvmfree(kpt, 1);
-  return NULL;
-}
-
-// only free page table, not physical pages
-void
-kfreewalk(pagetable_t kpt)
-{
-  for (int i = 0; i < 512; i++) {
-    pte_t pte = kpt[i];
-    if ((pte & PTE_V) && (pte & (PTE_R|PTE_W|PTE_X)) == 0) {
-      kfreewalk((pagetable_t) PTE2PA(pte));
-      kpt[i] = 0;
-    } else if (pte & PTE_V) {
-      break;
-    }
-  }
-  kfree((void *) kpt);
+  return asidbits ? i + 1 : 0;
 }
 
+// Switch this hart to p's page table.  With ASIDs, the
+// TLB keeps other address spaces' entries, and p's are
+// only flushed if they went stale since p last ran here.
+// Interrupts must be disabled.
 void
-kvmfreeusr(pagetable_t kpt)
-{
-  pte_t pte;
-  for (int i = 0; i < PX(2, MAXUVA); i++) {
-    pte = kpt[i];
-    if ((pte & PTE_V) && (pte & (PTE_R|PTE_W|PTE_X)) == 0) {
-      kfreewalk((pagetable_t) PTE2PA(pte));
-      kpt[i] = 0;
-    }
+uvmswitch(struct proc *p)
+{
+  uint64 hart = 1L << cpuid();
+
+  w_satp(MAKE_SATP(p->pagetable) | SATP_ASID(p->asid));
+  if(p->asid == 0)
+    sfence_vma();
+  else if(p->tlbstale & hart){
+    p->tlbstale &= ~hart;
+    sfence_vma_asid(p->asid);
   }
 }
 
+// The mappings of p, the current process, have changed,
+// or p->pagetable has been replaced: reload it and flush
+// this hart's TLB, and have the others flush theirs
+// before they next run p.
 void
-kvmfree(pagetable_t kpt, int stack_free)
+uvmflush(struct proc *p)
 {
-  if (stack_free) {
-    vmunmap(kpt, VKSTACK, 1, 1);
-    pte_t pte = kpt[PX(2, VKSTACK)];
-    if ((pte & PTE_V) && (pte & (PTE_R|PTE_W|PTE_X)) == 0) {
-      kfreewalk((pagetable_t) PTE2PA(pte));
-    }
-  }
-  kvmfreeusr(kpt);
-  kfree(kpt);
+  push_off();
+  p->tlbstale = ~0UL;
+  uvmswitch(p);
+  pop_off();
 }
 
 void vmprint(pagetable_t pagetable)
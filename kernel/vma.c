@@ -0,0 +1,387 @@
+// Memory-mapped files and anonymous memory.
+//
+// Each process has up to NVMA regions: those made by mmap(),
+// placed top-down between MMAPBASE and MMAPTOP, clear of the
+// heap, and the program segments that exec() maps privately.
+// Nothing is read or allocated by mmap() itself: pages are
+// faulted in on first touch by vma_fault().  File pages are
+// the page cache's own, so everyone mapping or reading a file
+// sees the same memory; MAP_PRIVATE ones are copied on write.
+// Pages of a writable MAP_SHARED file mapping are written back
+// through ewrite() when they are unmapped, by munmap(), exec()
+// or exit().
+
+#include "include/types.h"
+#include "include/param.h"
+#include "include/memlayout.h"
+#include "include/riscv.h"
+#include "include/spinlock.h"
+#include "include/sleeplock.h"
+#include "include/proc.h"
+#include "include/file.h"
+#include "include/fat32.h"
+#include "include/fcntl.h"
+#include "include/kalloc.h"
+#include "include/vm.h"
+#include "include/vma.h"
+#include "include/string.h"
+#include "include/printf.h"
+
+// Find the region holding va.
+struct vma*
+vma_find(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end && v->start <= va && va < v->end)
+      return v;
+  return NULL;
+}
+
+static struct vma*
+vma_alloc(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end == 0)
+      return v;
+  return NULL;
+}
+
+static int
+vma_nfree(struct proc *p)
+{
+  struct vma *v;
+  int n = 0;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end == 0)
+      n++;
+  return n;
+}
+
+// Does unmapping [start, end) leave a hole in the middle of
+// a region, so that its upper part needs a slot of its own?
+static int
+vma_splits(struct proc *p, uint64 start, uint64 end)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end && v->start < start && end < v->end)
+      return 1;
+  return 0;
+}
+
+// Does [start, end) overlap any region?
+static struct vma*
+vma_overlap(struct proc *p, uint64 start, uint64 end)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->end && v->start < end && start < v->end)
+      return v;
+  return NULL;
+}
+
+// Write back the pages of [a, b) in v that have been written,
+// if it is a writable shared file mapping, then unmap them.
+// The caller must flush the TLB.
+static void
+vma_zap(struct proc *p, struct vma *v, uint64 a, uint64 b)
+{
+  struct dirent *ep;
+  uint64 va, off;
+  uint n;
+
+  if(v->f && (v->flags & MAP_SHARED) && (v->prot & PROT_WRITE)){
+    ep = v->f->ep;
+    elock(ep);
+    for(va = a; va < b; va += PGSIZE){
+      pte_t *pte = walk(p->pagetable, va, 0);
+      off = v->off + (va - v->start);
+      // a mapping never makes the file longer.
+      if(pte == NULL || (*pte & (PTE_V | PTE_D)) != (PTE_V | PTE_D)
+         || off >= ep->file_size)
+        continue;
+      uint64 pa = PTE2PA(*pte);
+      n = ep->file_size - off < PGSIZE ? ep->file_size - off : PGSIZE;
+      if(ewrite(ep, 0, pa, off, n) != n)
+        printf("vma_zap: write back failed\n");
+    }
+    eunlock(ep);
+  }
+  uvmunmap(p->pagetable, a, (b - a) / PGSIZE, 1);
+}
+
+// Map len bytes of f at off, or anonymous memory, at addr if
+// MAP_FIXED, else wherever there is room, preferring addr.
+// Returns the address, or -1.
+uint64
+vma_map(struct proc *p, uint64 addr, uint64 len, int prot, int flags,
+        struct file *f, uint64 off)
+{
+  struct vma *v;
+  uint64 va;
+
+  if(len == 0 || len > MMAPTOP - MMAPBASE || off % PGSIZE != 0)
+    return -1;
+  len = PGROUNDUP(len);
+  if((flags & (MAP_SHARED | MAP_PRIVATE)) == 0)
+    return -1;
+  if(flags & MAP_ANONYMOUS){
+    f = 0;
+    off = 0;
+  } else {
+    if(f == 0 || f->type != FD_ENTRY || (f->ep->attribute & ATTR_DIRECTORY) || !f->readable)
+      return -1;
+    if((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+  }
+
+  if(flags & MAP_FIXED){
+    if(addr % PGSIZE != 0 || addr < MMAPBASE || addr > MMAPTOP - len)
+      return -1;
+    // make sure of a slot before unmapping what is there.
+    if(vma_nfree(p) < 1 + vma_splits(p, addr, addr + len))
+      return -1;
+    if(vma_unmap(p, addr, len) < 0)
+      return -1;
+    va = addr;
+  } else if(addr % PGSIZE == 0 && addr >= MMAPBASE && addr <= MMAPTOP - len
+            && vma_overlap(p, addr, addr + len) == NULL){
+    va = addr;
+  } else {
+    // highest hole that fits.
+    va = MMAPTOP - len;
+    while((v = vma_overlap(p, va, va + len)) != NULL){
+      if(v->start < MMAPBASE + len)
+        return -1;
+      va = v->start - len;
+    }
+  }
+
+  if((v = vma_alloc(p)) == NULL)
+    return -1;
+  v->start = va;
+  v->end = va + len;
+  v->prot = prot;
+  v->flags = flags;
+  v->f = f ? filedup(f) : 0;
+  v->off = off;
+  v->fsize = len;
+  return va;
+}
+
+// Unmap whatever is mapped in [addr, addr+len),
+// splitting regions as needed.
+// Returns 0, or -1 if a region would need
+// splitting and no slot is free.
+int
+vma_unmap(struct proc *p, uint64 addr, uint64 len)
+{
+  struct vma *v, *nv;
+  uint64 a, b, end;
+
+  if(addr % PGSIZE != 0 || len == 0)
+    return -1;
+  end = addr + PGROUNDUP(len);
+  if(end < addr)
+    return -1;
+  // fail before unmapping anything.
+  if(vma_splits(p, addr, end) && vma_nfree(p) == 0)
+    return -1;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end == 0 || v->end <= addr || end <= v->start)
+      continue;
+    a = v->start > addr ? v->start : addr;
+    b = v->end < end ? v->end : end;
+    if(v->start < a && b < v->end){
+      // a hole in the middle: the part above it becomes
+      // a region of its own, and the rest is trimmed below.
+      if((nv = vma_alloc(p)) == NULL)
+        panic("vma_unmap");
+      *nv = *v;
+      nv->start = b;
+      nv->off += b - v->start;
+      nv->fsize = v->fsize > b - v->start ? v->fsize - (b - v->start) : 0;
+      if(nv->f)
+        filedup(nv->f);
+      vma_zap(p, v, a, b);
+      v->end = a;
+      continue;
+    }
+    vma_zap(p, v, a, b);
+    if(a == v->start && b == v->end){
+      if(v->f)
+        fileclose(v->f);
+      memset(v, 0, sizeof(*v));
+    } else if(a == v->start){
+      v->off += b - v->start;
+      v->fsize = v->fsize > b - v->start ? v->fsize - (b - v->start) : 0;
+      v->start = b;
+    } else {
+      v->end = a;
+    }
+  }
+  uvmflush(p);
+  return 0;
+}
+
+// Fault in the page at va, which is in a region:
+// read it from the file, or zero it for anonymous memory,
+// or copy it if it is a copy-on-write page and write.
+// Returns 0 if the access can be retried.
+int
+vma_fault(struct proc *p, uint64 va, int write)
+{
+  struct vma *v;
+  pte_t *pte;
+  char *mem;
+  uint64 off;
+  int n, perm;
+
+  if((v = vma_find(p, va)) == NULL)
+    return -1;
+  if(v->prot == PROT_NONE || (write && !(v->prot & PROT_WRITE)))
+    return -1;
+  va = PGROUNDDOWN(va);
+  pte = walk(p->pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    if(write && (*pte & PTE_COW))
+      return uvmcow(p, va);
+    return -1;
+  }
+
+  perm = PTE_U | PTE_R;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+  mem = 0;
+  off = v->off + (va - v->start);
+  // bytes of this page that come from the file.
+  n = 0;
+  if(v->f && va - v->start < v->fsize)
+    n = v->fsize - (va - v->start) < PGSIZE ? v->fsize - (va - v->start) : PGSIZE;
+  if(n == PGSIZE){
+    elock(v->f->ep);
+    mem = (char*)epage_ref(v->f->ep, off);
+    eunlock(v->f->ep);
+  }
+  if(mem){
+    // the page cache's own page: shared with everyone
+    // using the file, copied on write if private.
+    if(v->prot & PROT_WRITE)
+      perm |= (v->flags & MAP_SHARED) ? PTE_W : PTE_COW;
+  } else {
+    // anonymous, partly or wholly past the file's part
+    // or EOF, or no memory for the cache.
+    if((mem = kalloc()) == NULL)
+      return -1;
+    if(n > 0){
+      elock(v->f->ep);
+      n = eread(v->f->ep, 0, (uint64)mem, off, n);
+      eunlock(v->f->ep);
+    }
+    memset(mem + n, 0, PGSIZE - n);
+    if(v->prot & PROT_WRITE)
+      perm |= PTE_W;
+  }
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    kfree(mem);
+    return -1;
+  }
+  if(write && (perm & PTE_COW))
+    return uvmcow(p, va);
+  return 0;
+}
+
+// Fault in the file-backed pages of [va, va+len) before
+// the kernel copies to (write) or from them while holding
+// locks that reading the file may need, or spinlocks.
+// Other pages are cheap to fault in later.
+int
+vma_prefault(struct proc *p, uint64 va, uint64 len, int write)
+{
+  struct vma *v;
+  uint64 a, b;
+  pte_t *pte;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end == 0 || v->f == 0 || v->end <= va || va + len <= v->start)
+      continue;
+    a = PGROUNDDOWN(v->start > va ? v->start : va);
+    b = v->end < va + len ? v->end : va + len;
+    for(; a < b; a += PGSIZE){
+      pte = walk(p->pagetable, a, 0);
+      if(pte && (*pte & PTE_V) && (!write || (*pte & PTE_W)))
+        continue;
+      if(vma_fault(p, a, write) < 0)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+// Give np the regions of p.  Pages already faulted in are
+// shared, copy-on-write unless MAP_SHARED.
+// Returns 0, or -1 with nothing mapped in np.
+int
+vma_fork(struct proc *p, struct proc *np)
+{
+  int i;
+  struct vma *v;
+  // exec()'s segments lie below p->sz, where
+  // uvmcopy() has shared their pages already.
+  uint64 sz = PGROUNDUP(p->sz);
+
+  for(i = 0; i < NVMA; i++){
+    v = &p->vma[i];
+    if(v->end == 0)
+      continue;
+    if(v->end > sz &&
+       uvmshare(p->pagetable, np->pagetable, v->start > sz ? v->start : sz,
+                v->end, !(v->flags & MAP_SHARED)) < 0)
+      goto err;
+    np->vma[i] = *v;
+    if(v->f)
+      filedup(v->f);
+  }
+  return 0;
+
+ err:
+  // p still holds the files, so fileclose() won't sleep.
+  while(i-- > 0){
+    v = &np->vma[i];
+    if(v->end == 0)
+      continue;
+    if(v->end > sz){
+      uint64 a = v->start > sz ? v->start : sz;
+      uvmunmap(np->pagetable, a, (v->end - a) / PGSIZE, 1);
+    }
+    if(v->f)
+      fileclose(v->f);
+    memset(v, 0, sizeof(*v));
+  }
+  return -1;
+}
+
+// Unmap every region, writing back shared file pages.
+void
+vma_exit(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->end == 0)
+      continue;
+    vma_zap(p, v, v->start, v->end);
+    if(v->f)
+      fileclose(v->f);
+    memset(v, 0, sizeof(*v));
+  }
+  uvmflush(p);
+}
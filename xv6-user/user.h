@@ -6,6 +6,14 @@ struct stat;
 struct rtcdate;
 struct sysinfo;
 
+#define SCHED_NORMAL  0
+#define SCHED_FIFO    1
+#define PRIO_PROCESS  0
+
+struct sched_param {
+  int sched_priority;
+};
+
 // system calls
 int fork(void);
 int exit(int) __attribute__((noreturn));
@@ -35,6 +43,13 @@ int sysinfo(struct sysinfo *);
 int rename(char *old, char *new);
 int shutdown(void); // call sbi_shutdown 
 int times(void);
+int sync(void);
+int fsync(int fd);
+void* mmap(void *addr, uint64 len, int prot, int flags, int fd, uint64 off);
+int munmap(void *addr, uint64 len);
+int setpriority(int which, int who, int prio);
+int getpriority(int which, int who);
+int sched_setscheduler(int pid, int policy, const struct sched_param*);
 // ulib.c
 int stat(const char*, struct stat*);
 char* strcpy(char*, const char*);
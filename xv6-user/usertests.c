@@ -2535,6 +2535,249 @@ execout(char *s)
   exit(0);
 }
 
+// does touching a page make a process die?
+int
+faults(char *a)
+{
+  int pid, xstatus;
+
+  pid = fork();
+  if(pid < 0){
+    printf("fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    *(volatile char *)a = 1;
+    exit(0);
+  }
+  wait(&xstatus);
+  return xstatus != 0;
+}
+
+// munmap() of part of a region, in the middle and at
+// either end, leaves the rest of it mapped.
+void
+mmapunmap(char *s)
+{
+  char *a;
+  int i;
+
+  a = mmap(0, 6*PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(a == (char*)-1){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 6; i++)
+    a[i*PGSIZE] = 'a' + i;
+  if(munmap(a + 2*PGSIZE, PGSIZE) < 0 || munmap(a, PGSIZE) < 0 ||
+     munmap(a + 5*PGSIZE, PGSIZE) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 6; i++){
+    if(i == 0 || i == 2 || i == 5){
+      if(!faults(a + i*PGSIZE)){
+        printf("%s: page %d still mapped\n", s, i);
+        exit(1);
+      }
+    } else if(a[i*PGSIZE] != 'a' + i){
+      printf("%s: page %d lost\n", s, i);
+      exit(1);
+    }
+  }
+  if(munmap(a, 6*PGSIZE) < 0){
+    printf("%s: munmap of holes failed\n", s);
+    exit(1);
+  }
+  if(!faults(a + PGSIZE)){
+    printf("%s: page 1 still mapped\n", s);
+    exit(1);
+  }
+}
+
+// writes to a MAP_SHARED file mapping reach the file,
+// and pages only read leave it alone.
+void
+mmapshared(char *s)
+{
+  char *a;
+  int fd, i;
+
+  remove("mmapshared");
+  fd = open("mmapshared", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 3; i++){
+    memset(buf, '0' + i, PGSIZE);
+    if(write(fd, buf, PGSIZE) != PGSIZE){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  a = mmap(0, 3*PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(a == (char*)-1){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if(a[PGSIZE] != '1'){
+    printf("%s: mapping doesn't match the file\n", s);
+    exit(1);
+  }
+  a[0] = 'x';
+  a[2*PGSIZE + 7] = 'y';
+  if(munmap(a, 3*PGSIZE) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("mmapshared", O_RDONLY);
+  if(fd < 0){
+    printf("%s: reopen failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 3; i++){
+    if(read(fd, buf, PGSIZE) != PGSIZE){
+      printf("%s: read failed\n", s);
+      exit(1);
+    }
+    for(int j = 0; j < PGSIZE; j++){
+      char c = '0' + i;
+      if(i == 0 && j == 0)
+        c = 'x';
+      if(i == 2 && j == 7)
+        c = 'y';
+      if(buf[j] != c){
+        printf("%s: page %d byte %d is %x not %x\n", s, i, j, buf[j], c);
+        exit(1);
+      }
+    }
+  }
+  close(fd);
+  remove("mmapshared");
+}
+
+// MAP_FIXED replaces what was there, and if it fails
+// for want of a region, the old mapping survives.
+void
+mmapfixed(char *s)
+{
+  char *a, *b;
+  int i;
+
+  a = mmap(0, 3*PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(a == (char*)-1){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 3; i++)
+    a[i*PGSIZE] = 'a' + i;
+  b = mmap(a + PGSIZE, PGSIZE, PROT_READ|PROT_WRITE,
+           MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0);
+  if(b != a + PGSIZE){
+    printf("%s: MAP_FIXED mapped at %p, not %p\n", s, b, a + PGSIZE);
+    exit(1);
+  }
+  if(a[0] != 'a' || a[PGSIZE] != 0 || a[2*PGSIZE] != 'c'){
+    printf("%s: MAP_FIXED didn't replace the middle page\n", s);
+    exit(1);
+  }
+
+  a = mmap(0, 3*PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if(a == (char*)-1){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < 3; i++)
+    a[i*PGSIZE] = 'a' + i;
+  // use up every region.
+  while(mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0) != (char*)-1)
+    ;
+  // the middle of a region leaves its top part
+  // needing a region of its own.
+  if(munmap(a + PGSIZE, PGSIZE) != -1){
+    printf("%s: munmap split without a free region\n", s);
+    exit(1);
+  }
+  b = mmap(a + PGSIZE, PGSIZE, PROT_READ|PROT_WRITE,
+           MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED, -1, 0);
+  if(b != (char*)-1){
+    printf("%s: MAP_FIXED worked without a free region\n", s);
+    exit(1);
+  }
+  if(a[0] != 'a' || a[PGSIZE] != 'b' || a[2*PGSIZE] != 'c'){
+    printf("%s: failed MAP_FIXED lost the old mapping\n", s);
+    exit(1);
+  }
+}
+
+// after fork, parent and child each see their own
+// writes to memory they share copy-on-write, and
+// not each other's.
+void
+cowfork(char *s)
+{
+  enum { N = 8 };
+  char *a;
+  int i, pid, xstatus;
+  int fds[2];
+  char c;
+
+  a = sbrk(N*PGSIZE);
+  if(a == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++)
+    a[i*PGSIZE] = 'p';
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[1]);
+    for(i = 0; i < N; i += 2)
+      a[i*PGSIZE] = 'c';
+    // wait for the parent's writes.
+    if(read(fds[0], &c, 1) != 1)
+      exit(1);
+    for(i = 0; i < N; i++){
+      if(a[i*PGSIZE] != (i % 2 == 0 ? 'c' : 'p')){
+        printf("%s: child sees %c at page %d\n", s, a[i*PGSIZE], i);
+        exit(1);
+      }
+    }
+    exit(0);
+  }
+  close(fds[0]);
+  for(i = 0; i < N; i++){
+    if(a[i*PGSIZE] != 'p'){
+      printf("%s: parent sees child's write at page %d\n", s, i);
+      exit(1);
+    }
+  }
+  for(i = 1; i < N; i += 2)
+    a[i*PGSIZE] = 'P';
+  write(fds[1], "x", 1);
+  close(fds[1]);
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(1);
+  for(i = 0; i < N; i++){
+    if(a[i*PGSIZE] != (i % 2 == 0 ? 'p' : 'P')){
+      printf("%s: parent sees %c at page %d\n", s, a[i*PGSIZE], i);
+      exit(1);
+    }
+  }
+}
+
 //
 // use sbrk() to count how many free physical memory pages there are.
 // touches the pages to force allocation.
@@ -2702,6 +2945,10 @@ main(int argc, char *argv[])
     {dirfile, "dirfile"},
     {iref, "iref"},
     {forktest, "forktest"},
+    {cowfork, "cowfork"},
+    {mmapunmap, "mmapunmap"},
+    {mmapshared, "mmapshared"},
+    {mmapfixed, "mmapfixed"},
               // {bigdir, "bigdir"}, // slow
     { 0, 0},
   };
@@ -55,8 +55,13 @@ entry("execve");
 entry("getppid");
 entry("gettimeofday");
 entry("nanosleep");
+entry("setpriority");
+entry("getpriority");
+entry("sched_setscheduler");
 entry("dup2");
 entry("getdents");
 entry("unlink");
 entry("mount");
-entry("umount");
\ No newline at end of file
+entry("umount");
+entry("sync");
+entry("fsync");
\ No newline at end of file